@@ -309,12 +309,16 @@ void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	envid_t reply_to = 0;
+	int perm = 0, r = 0;
+	void *pg = NULL;
 
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		// Answer the previous request and take the next one in a
+		// single system call.
+		req = ipc_reply_wait(reply_to, r, pg, perm,
+				     (envid_t *) &whom, fsreq, &perm);
+		reply_to = 0;
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
@@ -335,7 +339,9 @@ serve(void)
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
+		reply_to = whom;
+		// Don't keep the client's page mapped while we wait for the
+		// next request.
 		sys_page_unmap(0, fsreq);
 	}
 }
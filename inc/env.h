@@ -38,6 +38,27 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Values of env_rq_queued in struct Env
+enum {
+	ENV_RQ_NONE = 0,	// Not on any run queue
+	ENV_RQ_QUEUED,		// On some CPU's run queue
+	ENV_RQ_FREED,		// Freed, but a stale entry is still queued
+};
+
+// Scheduling priorities, see kern/sched.c.  Priorities from
+// ENV_PRIO_NICE_MIN to ENV_PRIO_NICE_MAX are nice values in the
+// weighted fair class: the lower the nice value, the larger the share
+// of CPU time.  Priorities from ENV_PRIO_RT_MIN to ENV_PRIO_RT_MAX are
+// real-time: they always run before any fair environment, higher
+// priorities first, round-robin within a priority.
+#define ENV_PRIO_NICE_MIN	(-10)
+#define ENV_PRIO_NICE_MAX	10
+#define ENV_PRIO_NORMAL		0
+#define ENV_PRIO_RT_MIN		16
+#define ENV_PRIO_RT_MAX		23
+#define ENV_PRIO_SERVER		20	// File and network servers
+#define ENV_PRIO_IS_RT(p)	((p) >= ENV_PRIO_RT_MIN)
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -55,11 +76,23 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling
+	struct Env *env_rq_link;	// Next env on its real-time run queue
+	uint32_t env_rq_queued;		// ENV_RQ_*
+	int env_priority;		// ENV_PRIO_*
+	uint64_t env_vruntime;		// Weighted run time, fair class only
+	uint64_t env_runtime;		// TSC cycles spent running
+	uint64_t env_timeout;		// TSC deadline if sleeping, else 0
+	struct Env *env_sleep_link;	// Next env to wake after us
+	physaddr_t env_futex_pa;	// Futex we wait on (page 0 is never mapped)
+	struct Env *env_futex_link;	// Next waiter in our futex queue
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_uxstacktop;	// Top of our user exception stack
 
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
@@ -67,6 +100,21 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+
+	// Blocking IPC send
+	struct Env *env_ipc_sendq_head;	// Oldest sender blocked on us
+	struct Env *env_ipc_sendq_tail;	// Newest sender blocked on us
+	struct Env *env_ipc_send_link;	// Next sender on the target's queue
+	struct Env *env_ipc_send_to;	// Env we are blocked sending to
+	uint32_t env_ipc_send_value;	// Value we are sending
+	void *env_ipc_send_srcva;	// Page we are sending, if < UTOP
+	int env_ipc_send_perm;		// Perm of the page we are sending
+	bool env_ipc_send_call;		// Queued send is an ipc_call
+	struct Env *env_ipc_callee;	// Only accept a reply from this env
+	struct Env *env_ipc_callers;	// Envs waiting for our reply
+	struct Env *env_ipc_caller_link;	// Next on our callee's env_ipc_callers
+	uint32_t env_ipc_donations;	// Times we gave our slice to a receiver
+	uint32_t env_ipc_donated;	// Times a sender gave us its slice
 };
 
 #endif // !JOS_INC_ENV_H
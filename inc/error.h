@@ -16,6 +16,7 @@ enum {
 
 	E_IPC_NOT_RECV	,	// Attempt to send to env that is not recving
 	E_EOF		,	// Unexpected end of file
+	E_TIMEOUT	,	// Wait timed out
 
 	// File system error codes -- only seen in user-level
 	E_NO_DISK	,	// No free space left on disk
@@ -29,6 +30,7 @@ enum {
 	// Network error code
 	E_PKT_LONG	,
 	E_NO_FREE	,
+	E_BUSY		,	// NIC rings are mapped by SYS_net_map
 
 	MAXERROR
 };
@@ -22,6 +22,7 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/x86.h>
 
 #define USED(x)		(void)(x)
 
@@ -30,10 +31,40 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
+// Threads made by sfork share all memory, so each one gets a slot of
+// THREAD_SLOTSIZE bytes just below UXSTACKTOP for what it must not
+// share.  From the top down, a slot holds the exception stack page, an
+// empty page, the stack page, more empty pages, and at its base the
+// thread's ThreadLocal.  Slot 0 belongs to the main thread; its stacks
+// are the usual ones, and its ThreadLocal is thread_main, which is also
+// used when running on any stack outside the other slots.
+#define THREAD_SLOTSIZE		(8 * PGSIZE)
+#define THREAD_NSLOTS		32
+#define THREAD_SLOTS		(UXSTACKTOP - THREAD_NSLOTS * THREAD_SLOTSIZE)
+
+struct ThreadLocal {
+	struct BatchRing tl_ring;		// Queued system calls (batch.c)
+	int tl_batch_err;			// First error from an early flush
+	const volatile struct Env *tl_env;	// Our Env structure in envs[]
+};
+
+extern struct ThreadLocal thread_main;
+
+static __inline struct ThreadLocal *
+thread_local(void)
+{
+	uintptr_t esp = read_esp();
+
+	if (esp >= THREAD_SLOTS && esp < UXSTACKTOP - THREAD_SLOTSIZE)
+		return (struct ThreadLocal *) ROUNDDOWN(esp, THREAD_SLOTSIZE);
+	return &thread_main;
+}
+
+#define thisenv		(thread_local()->tl_env)
+
 // exit.c
 void	exit(void);
 
@@ -43,7 +74,11 @@ void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
 // readline.c
 char*	readline(const char *buf);
 
+// sort.c
+void	sort(uint32_t *v, int n);
+
 // syscall.c
+extern bool syscall_use_sysenter;
 void	sys_cputs(const char *string, size_t len);
 int	sys_cgetc(void);
 envid_t	sys_getenvid(void);
@@ -57,11 +92,30 @@ int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_alloc_large(envid_t env, void *va, int perm);
+int	sys_env_set_priority(envid_t env, int priority);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
 unsigned int sys_time_msec(void);
+unsigned int sys_time_usec(void);
+int	sys_sleep_usec(unsigned int usec);
 int	sys_net_output(const char* va, int len);
 int	sys_net_input(char* va, int* len);
+int	sys_net_recv(char *va, int *len);
+int	sys_net_recv_page(void *va);
+int	sys_net_send_batch(const struct NetFrag *frags, int nfrags,
+			   struct NetTxSeq *seq);
+int	sys_net_recv_batch(struct NetBatch *b, int maxcopy);
+int	sys_net_map(void *va);
+int	sys_net_sync(int wait);
+int	sys_batch(struct BatchRing *ring);
+envid_t	sys_fork(void);
+envid_t	sys_sfork(uintptr_t eip, uintptr_t esp, uintptr_t xstacktop);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned int usec);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -76,15 +130,45 @@ sys_exofork(void)
 	return ret;
 }
 
+// batch.c
+void	batch_page_alloc(envid_t env, void *pg, int perm);
+void	batch_page_map(envid_t src_env, void *src_pg,
+		       envid_t dst_env, void *dst_pg, int perm);
+void	batch_page_unmap(envid_t env, void *pg);
+void	batch_env_set_status(envid_t env, int status);
+void	batch_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	batch_flush(void);
+
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	ufork(void);
+envid_t	sfork(void (*entry)(void *), const void *arg, size_t len);
+
+// mutex.c
+struct Mutex {
+	volatile uint32_t m_state;	// 0 free, 1 held, 2 held with waiters
+};
+struct Cond {
+	volatile uint32_t c_seq;	// Bumped by every signal
+};
+void	mutex_init(struct Mutex *m);
+void	mutex_lock(struct Mutex *m);
+bool	mutex_trylock(struct Mutex *m);
+void	mutex_unlock(struct Mutex *m);
+void	cond_init(struct Cond *c);
+void	cond_wait(struct Cond *c, struct Mutex *m);
+int	cond_timedwait(struct Cond *c, struct Mutex *m, unsigned int usec);
+void	cond_signal(struct Cond *c);
+void	cond_broadcast(struct Cond *c);
 
 // fd.c
 int	close(int fd);
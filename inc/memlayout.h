@@ -178,6 +178,8 @@ extern volatile pde_t uvpd[];     // VA of current page directory
 struct PageInfo {
 	// Next page on the free list.
 	struct PageInfo *pp_link;
+	// Previous page on the buddy allocator's free list.
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -185,6 +187,11 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// For the first page of a free buddy block, its order (it spans
+	// 1 << pp_order pages), and pp_free is set.
+	uint8_t pp_order;
+	uint8_t pp_free;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -69,12 +69,22 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// PTE_COW marks copy-on-write page table entries.
+// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
+#define PTE_COW		0x800
+
+// PTE_SHARE marks pages that fork and spawn share rather than copy.
+#define PTE_SHARE	0x400
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
 
+// Address of a 4MB page in its page directory entry (PTE_PS set)
+#define PDE_ADDR_PS(pde)	((physaddr_t) (pde) & ~(PTSIZE - 1))
+
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
 #define CR0_MP		0x00000002	// Monitor coProcessor
@@ -89,6 +99,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -96,6 +107,10 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 
+// Feature flags returned in %edx by CPUID with %eax = 1
+#define CPUID_EDX_PSE	0x00000008	// 4MB pages
+#define CPUID_EDX_PGE	0x00002000	// Global pages (PTE_G)
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
@@ -5,10 +5,16 @@
 
 #include <inc/types.h>
 #include <inc/mmu.h>
+#include <inc/syscall.h>
 #include <lwip/sockets.h>
 
+// A frame passed from the input helper to the network server.  The
+// frame starts where sys_net_recv_page puts it, so a page straight from
+// the NIC is already a jif_pkt once jp_len is filled in, and the server
+// can build its pbuf header in the space in front.
 struct jif_pkt {
 	int jp_len;
+	char jp_pad[NET_RXPAGE_DATA - sizeof(int)];
 	char jp_data[0];
 };
 
@@ -27,10 +33,14 @@ enum {
 	NSREQ_SEND,
 	NSREQ_SOCKET,
 
-	// The following two messages pass a page containing a struct jif_pkt
+	// NSREQ_INPUT passes a page containing a struct jif_pkt, and
+	// NSREQ_INPUT_BATCH one containing a struct NetBatch of frames
+	// that were small enough to copy
 	NSREQ_INPUT,
+	NSREQ_INPUT_BATCH,
 	// NSREQ_OUTPUT, unlike all other messages, is sent *from* the
-	// network server, to the output environment
+	// network server, to the output environment, with a page
+	// containing a struct NetBatch
 	NSREQ_OUTPUT,
 
 	// The following message passes no page
@@ -98,6 +108,7 @@ union Nsipc {
 	} socket;
 
 	struct jif_pkt pkt;
+	struct NetBatch batch;
 
 	// Ensure Nsipc is one page
 	char _pad[PGSIZE];
@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -17,10 +19,145 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
 	SYS_time_msec,
+	SYS_time_usec,
+	SYS_sleep_usec,
 	SYS_net_output,
 	SYS_net_input,
+	SYS_batch,
+	SYS_env_set_priority,
+	SYS_page_alloc_large,
+	SYS_fork,
+	SYS_sfork,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_net_recv,
+	SYS_net_recv_page,
+	SYS_net_send_batch,
+	SYS_net_recv_batch,
+	SYS_net_map,
+	SYS_net_sync,
 	NSYSCALLS
 };
 
+// A system call queued in a BatchRing.  Only SYS_page_alloc,
+// SYS_page_map, SYS_page_unmap, SYS_env_set_status and
+// SYS_ipc_try_send may be batched.
+struct SyscallDesc {
+	uint32_t sd_num;		// SYS_* number
+	uint32_t sd_args[5];		// Arguments, as for the direct call
+	int32_t sd_ret;			// Result, filled in by the kernel
+};
+
+// Or'ed into the perm argument of SYS_ipc_try_send or SYS_ipc_send:
+// if the message is delivered at once, the sender gives the rest of
+// its time slice to the receiver, which runs immediately on the
+// sender's CPU.  Ignored inside SYS_batch.
+#define IPC_DONATE	0x1000
+
+// SYS_net_recv_page maps a received frame's page with the frame
+// starting this many bytes in, leaving room in front for the
+// receiver's own header.
+#define NET_RXPAGE_DATA	64
+
+// One piece of a frame for SYS_net_send_batch: nf_len bytes starting
+// nf_off bytes into the page mapped at nf_page.  The last piece of each
+// frame has NET_FRAG_EOP in nf_flags.
+struct NetFrag {
+	void *nf_page;
+	uint16_t nf_off;
+	uint16_t nf_len;
+	uint32_t nf_flags;
+};
+
+#define NET_FRAG_EOP	0x1
+
+#define NET_MAXFRAGS	8		// Pieces per frame
+#define NET_BATCH_MAX	32		// Frames per batch
+#define NET_BATCH_MAXFRAGS 64		// Pieces per SYS_net_send_batch
+
+// Frame numbers reported by SYS_net_send_batch.  Frames are numbered in
+// the order they are queued, by anyone, and the NIC finishes them in
+// that order; frame n's pages may be reused once (int32_t) (ts_done -
+// n) > 0.
+struct NetTxSeq {
+	uint32_t ts_sent;		// Number of the first frame just queued
+	uint32_t ts_done;		// Frames before this one are done
+};
+
+// A page of frames: frame i is nb_frames[i].nbf_len bytes starting
+// nb_frames[i].nbf_off bytes into the page.  SYS_net_recv_batch fills
+// one in, and the network server sends its output environment these.
+struct NetBatch {
+	uint32_t nb_count;
+	struct {
+		uint16_t nbf_off;
+		uint16_t nbf_len;
+	} nb_frames[NET_BATCH_MAX];
+};
+
+// The NIC's descriptors, as SYS_net_map maps them.
+struct NetTxDesc {
+	uint64_t td_addr;
+	uint16_t td_len;
+	uint8_t td_cso;
+	uint8_t td_cmd;
+	volatile uint8_t td_status;	// NET_TXD_DD once the NIC is done
+	uint8_t td_css;
+	uint16_t td_special;
+};
+
+struct NetRxDesc {
+	uint64_t rd_addr;
+	volatile uint16_t rd_len;
+	uint16_t rd_csum;
+	volatile uint8_t rd_status;	// NET_RXD_DD once a frame is in
+	uint8_t rd_errors;
+	uint16_t rd_special;
+} __attribute__((packed));
+
+#define NET_TXD_DD	0x01
+#define NET_RXD_DD	0x01
+
+#define NET_MAP_MAXSLOTS 256
+
+// The first page of what SYS_net_map maps; the other offsets are from
+// here.  After it come the NIC's descriptor rings, read-only, then one
+// page per receive slot, holding the frame NET_RXPAGE_DATA bytes in,
+// then the transmit buffers.
+//
+// Receive slot nm_rx_head holds a frame once its descriptor has
+// NET_RXD_DD; the user advances nm_rx_head past the slots it is done
+// with.  To send, the user copies a frame into the buffer of transmit
+// slot nm_tx_head, provided that slot's descriptor has NET_TXD_DD and
+// nm_tx_head + 1 is not nm_tx_cur, sets its nm_tx_len and advances
+// nm_tx_head.  SYS_net_sync hands both kinds of slots to the NIC.
+struct NetMap {
+	// Set by the kernel
+	uint32_t nm_ntx, nm_nrx;		// Slots in each ring
+	uint32_t nm_txring, nm_rxring;		// Descriptor rings
+	uint32_t nm_rxbuf;			// First receive page
+	uint32_t nm_txbuf, nm_txbuf_size;	// Transmit buffers, back to back
+	volatile uint32_t nm_tx_cur;		// Next slot the NIC will be given
+	// Set by the user
+	volatile uint32_t nm_tx_head;
+	volatile uint32_t nm_rx_head;
+	volatile uint16_t nm_tx_len[NET_MAP_MAXSLOTS];
+};
+
+#define BATCH_RING_SIZE	64		// Must be a power of 2
+
+// Submission and completion ring for SYS_batch, in user memory.
+// The user fills br_desc[br_tail % BATCH_RING_SIZE] and advances
+// br_tail; SYS_batch runs descriptors from br_head up to br_tail in
+// order, stores each result in place, and advances br_head past them.
+struct BatchRing {
+	volatile uint32_t br_head;	// Next descriptor to run
+	volatile uint32_t br_tail;	// Next free descriptor
+	struct SyscallDesc br_desc[BATCH_RING_SIZE];
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
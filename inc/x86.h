@@ -293,4 +293,66 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Model-specific registers
+#define MSR_IA32_SYSENTER_CS	0x174
+#define MSR_IA32_SYSENTER_ESP	0x175
+#define MSR_IA32_SYSENTER_EIP	0x176
+
+// CPUID leaf 1 feature bits (EDX)
+#define CPUID_EDX_SEP		(1 << 11)	// sysenter/sysexit
+
+// Does this CPU implement sysenter and sysexit?  The kernel sets up
+// the sysenter MSRs on every CPU that does.
+static inline bool
+sysenter_supported(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	return (edx & CPUID_EDX_SEP) != 0;
+}
+
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+
+	asm volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+// Atomically add incr to *addr, returning the old value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t incr)
+{
+	uint32_t result;
+
+	asm volatile("lock; xaddl %0, %1" :
+			"=r" (result), "+m" (*addr) :
+			"0" (incr) :
+			"cc", "memory");
+	return result;
+}
+
+// Atomically set *addr to newval if it currently holds oldval.
+// Returns the value *addr held before the operation, so the swap
+// happened iff the result equals oldval.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1" :
+			"=a" (result), "+m" (*addr) :
+			"r" (newval), "0" (oldval) :
+			"cc", "memory");
+	return result;
+}
+
 #endif /* !JOS_INC_X86_H */
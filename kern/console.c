@@ -8,6 +8,7 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -404,10 +405,17 @@ kbd_init(void)
 #define CONSBUFSIZE 512
 
 static struct {
+	struct spinlock lock;
 	uint8_t buf[CONSBUFSIZE];
 	uint32_t rpos;
 	uint32_t wpos;
-} cons;
+} cons = {
+	.lock = SPINLOCK_INIT("cons.lock", LOCK_RANK_CONSIN),
+};
+
+// Serializes console output, so lines printed by different CPUs
+// do not interleave.  Taken by vcprintf.
+struct spinlock cons_lock = SPINLOCK_INIT("cons_lock", LOCK_RANK_CONS);
 
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
@@ -416,6 +424,7 @@ cons_intr(int (*proc)(void))
 {
 	int c;
 
+	spin_lock(&cons.lock);
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
@@ -423,6 +432,7 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
+	spin_unlock(&cons.lock);
 }
 
 // return the next input character from the console, or 0 if none waiting
@@ -438,13 +448,15 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	spin_lock(&cons.lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	spin_unlock(&cons.lock);
+	return c;
 }
 
 // output a character to the console
@@ -6,6 +6,7 @@
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
 #include <inc/env.h>
+#include <kern/spinlock.h>
 
 // Maximum number of CPUs
 #define NCPU  8
@@ -17,12 +18,71 @@ enum {
 	CPU_HALTED,
 };
 
+#define NRTPRIO		(ENV_PRIO_RT_MAX - ENV_PRIO_RT_MIN + 1)
+
+// Per-CPU queues of runnable environments: one FIFO per real-time
+// priority, linked through env_rq_link, and a min-heap on env_vruntime
+// for the fair class.  See kern/sched.c.
+struct Runqueue {
+	struct spinlock rq_lock;
+	struct Env *rq_rt_head[NRTPRIO];	// Next env at each RT priority
+	struct Env *rq_rt_tail[NRTPRIO];
+	struct Env *rq_fair[NENV];	// Heap of fair envs by env_vruntime
+	uint32_t rq_nfair;		// Number of entries in rq_fair
+	uint64_t rq_min_vruntime;	// Lower bound for queued vruntimes
+	uint32_t rq_len;		// Number of queued environments
+};
+
+// Per-CPU cache of free pages in front of page_free_list, linked
+// through pp_link.  Only its own CPU touches it.  See kern/pmap.c.
+struct PageMagazine {
+	struct PageInfo *pm_head;	// Cached free pages
+	uint32_t pm_count;		// Number of pages cached
+	struct PageInfo *pm_zhead;	// Cached pre-zeroed pages
+	uint32_t pm_zcount;		// Number of pre-zeroed pages cached
+	uint32_t pm_nalloc;		// page_alloc calls on this CPU
+	uint32_t pm_nzeroed;		// ALLOC_ZERO calls served pre-zeroed
+	uint32_t pm_nfree;		// page_free calls on this CPU
+	uint32_t pm_nrefill;		// Batches taken from page_free_list
+	uint32_t pm_ndrain;		// Batches given back to it
+};
+
+// TLB invalidations that other CPUs still have to carry out, queued
+// by tlb_invalidate and sent as one shootdown by tlb_shootdown.  Only
+// its own CPU writes it; targets read it.  See kern/pmap.c.
+#define TLB_BATCH	32
+struct TlbBatch {
+	uint32_t tb_targets;		// CPUs (bit i is cpus[i]) to interrupt
+	volatile uint32_t tb_pending;	// Targets yet to acknowledge
+	bool tb_all;			// Batch overflowed: flush whole TLBs
+	uint32_t tb_n;			// Entries in tb_ent
+	struct {
+		pde_t *te_pgdir;
+		uintptr_t te_va;
+	} tb_ent[TLB_BATCH];
+	struct PageInfo *tb_free;	// Pages to free once all have flushed
+	uint32_t tb_nshootdown;		// Shootdowns sent
+	uint32_t tb_nipi;		// IPIs sent for them
+};
+
 // Per-CPU state
 struct CpuInfo {
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	struct Runqueue cpu_runq;       // Environments waiting for this CPU
+	struct PageMagazine cpu_pagemag; // Free pages cached for this CPU
+	pde_t *cpu_pgdir;               // Page directory loaded in %cr3
+	struct TlbBatch cpu_tlb;        // Invalidations owed to other CPUs
+	uint64_t cpu_run_start;         // TSC when cpu_env was last charged
+	uint64_t cpu_timer_deadline;    // TSC at which our timer will fire
+	bool cpu_tickless;              // Idle, timer armed for sleepers only
+	uintptr_t cpu_ufixup;           // Where a faulting user_copy resumes
+#ifdef DEBUG_SPINLOCK
+	struct spinlock *cpu_locks[NLOCKHELD];  // Locks held, for lock ordering
+	int cpu_nlocks;
+#endif
 };
 
 // Initialized in mpconfig.c
@@ -42,5 +102,7 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+void lapic_timer_oneshot(uint32_t usec);
 
 #endif
@@ -1,25 +1,95 @@
 #include <kern/e1000.h>
 #include <inc/string.h>
 #include <inc/error.h>
+#include <kern/spinlock.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/picirq.h>
+#include <kern/syscall.h>
 
 // LAB 6: Your driver code here
-struct tx_desc tx_queue[E1000_TXDESC] __attribute__ ((aligned (16)));
-struct packet pkt_bufs[E1000_TXDESC];
+volatile uint32_t* e1000;
+uint8_t e1000_irq;		// 0 until attached (IRQ 0 is the timer)
 
-struct rx_desc rx_queue[E1000_RXDESC] __attribute__ ((aligned (16)));
-struct rx_packet rx_pkt_bufs[E1000_RXDESC];
+// The descriptor rings share one page and the transmit buffers are a
+// physically contiguous block, both from page_alloc_order.
+struct tx_desc *tx_queue;
+struct packet *pkt_bufs;
+
+// A transmit descriptor points either at its pkt_bufs entry or into a
+// page of the sender's, which e1000_transmit_frags pins with a
+// reference until the NIC is done with it.  tx_clean is the oldest
+// descriptor queued but not yet reclaimed.  tx_sent and tx_done count
+// the frames queued and the frames reclaimed.
+static struct PageInfo *tx_pinned[E1000_TXDESC];
+static uint32_t tx_clean;
+static uint32_t tx_sent, tx_done;
+
+// Each receive descriptor has a page of its own, with the NIC writing
+// the frame NET_RXPAGE_DATA bytes in, so that e1000_receive_page can
+// hand the page itself to an environment.  The driver keeps one
+// reference on every page of rx_pool and a second one on those in the
+// ring; a page whose count is back to one is free to go in the ring
+// again.  Reference counts are protected by pmap_lock.
+struct rx_desc *rx_queue;
+static struct PageInfo *rx_pages[E1000_RXDESC];
+static struct PageInfo *rx_pool[E1000_RXPOOL];
+static int rx_pool_next;
+
+// Protects both descriptor rings, the TDT/RDT registers and rx_waiter
+static struct spinlock e1000_lock = SPINLOCK_INIT("e1000_lock", LOCK_RANK_E1000);
+
+// The environment sleeping in e1000_receive_wait, if any.  Receive
+// interrupts are unmasked only while it sleeps.
+static struct Env *rx_waiter;
+
+// The address space the rings are mapped into by e1000_map, if any,
+// where, and the control page shared with it.  While they are mapped,
+// the rings belong to that address space, and the other calls fail
+// with -E_BUSY.  nm_pgdir and nm_va change only with both pmap_lock
+// and e1000_lock held, so either is enough to look at them.
+static pde_t *nm_pgdir;
+static uintptr_t nm_va;
+static struct PageInfo *nm_page;
+static struct NetMap *nm;
 
 int pci_network_attach(struct pci_func *pcif) {
 
 	//TODO
+	static_assert(sizeof(struct tx_desc) * E1000_TXDESC +
+		      sizeof(struct rx_desc) * E1000_RXDESC <= PGSIZE);
+	static_assert(sizeof(struct packet) * E1000_TXDESC <=
+		      PGSIZE << E1000_TXBUF_ORDER);
+	static_assert(NET_RXPAGE_DATA + RX_PKTSIZE <= PGSIZE);
+	static_assert(sizeof(struct tx_desc) == sizeof(struct NetTxDesc));
+	static_assert(sizeof(struct rx_desc) == sizeof(struct NetRxDesc));
+	static_assert(E1000_TXDESC <= NET_MAP_MAXSLOTS);
+	static_assert(sizeof(struct NetMap) <= PGSIZE);
+	struct PageInfo *rings, *txbufs;
+	int i;
+
+	if (!(rings = page_alloc_order(0, ALLOC_ZERO)) ||
+	    !(txbufs = page_alloc_order(E1000_TXBUF_ORDER, ALLOC_ZERO)))
+		panic("pci_network_attach: out of memory");
+	for (i = 0; i < E1000_RXPOOL; i++) {
+		if (!(rx_pool[i] = page_alloc(ALLOC_ZERO)))
+			panic("pci_network_attach: out of memory");
+		rx_pool[i]->pp_ref = 1;
+	}
+	// Never freed.  Every page of txbufs gets a reference, as
+	// e1000_map maps them one by one.
+	rings->pp_ref = 1;
+	for (i = 0; i < (1 << E1000_TXBUF_ORDER); i++)
+		txbufs[i].pp_ref = 1;
+	tx_queue = page2kva(rings);
+	rx_queue = (struct rx_desc *) (tx_queue + E1000_TXDESC);
+	pkt_bufs = page2kva(txbufs);
+
 	pci_func_enable(pcif);
 	physaddr_t e1000_phys = pcif->reg_base[0];
 	e1000 = mmio_map_region(e1000_phys, pcif->reg_size[0]);
 
 	//initialisation Transmission
-	memset(tx_queue, 0, sizeof(struct tx_desc) * E1000_TXDESC);
-	memset(pkt_bufs, 0, sizeof(struct packet) * E1000_TXDESC);
-	int i;
 	for(i = 0; i < E1000_TXDESC; i++ ) {
 		tx_queue[i].addr = PADDR(pkt_bufs[i].pkt);
 		tx_queue[i].status |= E1000_TXD_STAT_DD;
@@ -46,10 +116,10 @@ int pci_network_attach(struct pci_func *pcif) {
 	e1000[E1000_TIPG] |= 0xA; // IPGR
 
 	//Initialise Reception
-	memset(rx_queue, 0, sizeof(struct rx_desc) * E1000_RXDESC);
-	memset(rx_pkt_bufs, 0, sizeof(struct rx_packet) * E1000_RXDESC);
 	for(i = 0; i < E1000_RXDESC; i++ ) {
-		rx_queue[i].addr = PADDR(rx_pkt_bufs[i].pkt);
+		rx_pages[i] = rx_pool[i];
+		rx_pages[i]->pp_ref++;
+		rx_queue[i].addr = page2pa(rx_pages[i]) + NET_RXPAGE_DATA;
 		rx_queue[i].status &= ~E1000_RXD_STAT_DD;
 	}
 
@@ -74,35 +144,193 @@ int pci_network_attach(struct pci_func *pcif) {
 	e1000[E1000_RCTL] &= ~E1000_RCTL_RDMTS;
 	e1000[E1000_RCTL] &= ~E1000_RCTL_MO;
 
+	// Receive interrupts, masked until someone waits for a packet.
+	// RXT0 fires as soon as a packet is in, up to the ITR rate.
+	e1000[E1000_IMC] = ~0;
+	e1000[E1000_RDTR] = 0;
+	e1000[E1000_ITR] = E1000_ITR_INTERVAL;
+	(void) e1000[E1000_ICR];
+	e1000_irq = pcif->irq_line;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << e1000_irq));
+
 	return 0;
 }
 
+// Reclaim the transmit descriptors the NIC has finished with, moving
+// the pages they pinned to unpin[0..*nunpin), and return the number of
+// free descriptors.  Called with e1000_lock held; the caller drops the
+// pins with tx_unpin once it has released it, as page_lock ranks
+// below e1000_lock.
+static int
+tx_reclaim(struct PageInfo **unpin, int *nunpin)
+{
+	uint32_t tdt = e1000[E1000_TDT];
+
+	*nunpin = 0;
+	while (tx_clean != tdt &&
+	       (tx_queue[tx_clean].status & E1000_TXD_STAT_DD)) {
+		if (tx_pinned[tx_clean]) {
+			unpin[(*nunpin)++] = tx_pinned[tx_clean];
+			tx_pinned[tx_clean] = NULL;
+		}
+		if (tx_queue[tx_clean].cmd & E1000_TXD_CMD_EOP)
+			tx_done++;
+		tx_clean = (tx_clean + 1) % E1000_TXDESC;
+	}
+	// TDT must stay behind TDH, so one descriptor is always unused.
+	return E1000_TXDESC - 1 -
+		(tdt + E1000_TXDESC - tx_clean) % E1000_TXDESC;
+}
+
+// Called with pmap_lock held.
+static void
+tx_unpin(struct PageInfo **unpin, int nunpin)
+{
+	while (nunpin > 0)
+		page_decref(unpin[--nunpin]);
+}
+
 int e1000_transmit(const char* data, int len) {
+	struct PageInfo *unpin[E1000_TXDESC];
+	int nunpin, r = 0;
 
 	if ( len > TX_PKTSIZE ) return -E_PKT_LONG;
+	if (len < 0) return -E_INVAL;
+	spin_lock(&pmap_lock);
+	spin_lock(&e1000_lock);
 	uint32_t tdt = e1000[E1000_TDT];
-	if ( !(tx_queue[tdt].status & E1000_TXD_STAT_DD) ) return -E_NO_FREE;
+	if (nm_pgdir) {
+		nunpin = 0;
+		r = -E_BUSY;
+		goto out;
+	}
+	if (tx_reclaim(unpin, &nunpin) < 1) {
+		r = -E_NO_FREE;
+		goto out;
+	}
 
-	memmove(pkt_bufs[tdt].pkt, data, len);
+	if ((r = user_copy_in(pkt_bufs[tdt].pkt, data, len)) < 0)
+		goto out;
+	tx_queue[tdt].addr = PADDR(pkt_bufs[tdt].pkt);
 	tx_queue[tdt].length = len;
 
 	//reset DD bit
 	tx_queue[tdt].status &= ~E1000_TXD_STAT_DD;
 	//set report status bit
-	tx_queue[tdt].cmd |= E1000_TXD_CMD_RS | E1000_TXD_CMD_EOP;
+	tx_queue[tdt].cmd = E1000_TXD_CMD_RS | E1000_TXD_CMD_EOP;
+	tx_sent++;
 	e1000[E1000_TDT] = (tdt + 1) % E1000_TXDESC;
+out:
+	spin_unlock(&e1000_lock);
+	tx_unpin(unpin, nunpin);
+	spin_unlock(&pmap_lock);
+	return r;
+}
 
-	return 0;
+// Queue the frames made of frags[0..nfrags), pieces of pages mapped in
+// curenv, with one descriptor per piece and EOP on the last piece of
+// each frame, so that the NIC reads them straight out of those pages.
+// Only whole frames are queued, as many as there are free descriptors
+// for, and TDT is written once.  Each page is pinned until its
+// descriptor is reclaimed, which happens here, on a later call.
+// Stores the frame counts in *seq (see struct NetTxSeq); ts_sent is
+// only meaningful if a frame was queued.
+//
+// Returns the number of frames queued, or < 0 on error.  Errors are:
+//	-E_INVAL if a piece is empty, crosses the end of its page, or
+//		is in a page that is not mapped PTE_U in curenv, or a
+//		frame has more than NET_MAXFRAGS pieces, or the last
+//		piece does not end a frame.
+//	-E_PKT_LONG if a frame is longer than TX_PKTSIZE.
+int
+e1000_transmit_frags(const struct NetFrag *frags, int nfrags,
+		     struct NetTxSeq *seq)
+{
+	struct PageInfo *pin[NET_BATCH_MAXFRAGS], *unpin[E1000_TXDESC];
+	int i, len = 0, npieces = 0, nfree, nunpin, nqueued, nframes = 0;
+	uint32_t tdt;
+	pte_t *pte;
+
+	for (i = 0; i < nfrags; i++) {
+		if (!frags[i].nf_len || PGOFF(frags[i].nf_page) ||
+		    frags[i].nf_off + frags[i].nf_len > PGSIZE ||
+		    ++npieces > NET_MAXFRAGS)
+			return -E_INVAL;
+		len += frags[i].nf_len;
+		if (len > TX_PKTSIZE)
+			return -E_PKT_LONG;
+		if (frags[i].nf_flags & NET_FRAG_EOP)
+			len = npieces = 0;
+	}
+	if (nfrags > 0 && !(frags[nfrags - 1].nf_flags & NET_FRAG_EOP))
+		return -E_INVAL;
 
+	spin_lock(&pmap_lock);
+	for (i = 0; i < nfrags; i++)
+		if ((uintptr_t) frags[i].nf_page >= UTOP ||
+		    !(pin[i] = page_lookup(curenv->env_pgdir,
+					   frags[i].nf_page, &pte)) ||
+		    !(*pte & PTE_U)) {
+			spin_unlock(&pmap_lock);
+			return -E_INVAL;
+		}
+
+	spin_lock(&e1000_lock);
+	if (nm_pgdir) {
+		spin_unlock(&e1000_lock);
+		spin_unlock(&pmap_lock);
+		return -E_BUSY;
+	}
+	tdt = e1000[E1000_TDT];
+	nfree = tx_reclaim(unpin, &nunpin);
+	// Back off to the end of the last frame that fits
+	for (nqueued = MIN(nfrags, nfree); nqueued > 0; nqueued--)
+		if (frags[nqueued - 1].nf_flags & NET_FRAG_EOP)
+			break;
+	seq->ts_sent = tx_sent;
+	for (i = 0; i < nqueued; i++) {
+		pin[i]->pp_ref++;
+		tx_pinned[tdt] = pin[i];
+		tx_queue[tdt].addr = page2pa(pin[i]) + frags[i].nf_off;
+		tx_queue[tdt].length = frags[i].nf_len;
+		tx_queue[tdt].status &= ~E1000_TXD_STAT_DD;
+		tx_queue[tdt].cmd = E1000_TXD_CMD_RS;
+		if (frags[i].nf_flags & NET_FRAG_EOP) {
+			tx_queue[tdt].cmd |= E1000_TXD_CMD_EOP;
+			nframes++;
+		}
+		tdt = (tdt + 1) % E1000_TXDESC;
+	}
+	if (nframes > 0) {
+		tx_sent += nframes;
+		e1000[E1000_TDT] = tdt;
+	}
+	seq->ts_done = tx_done;
+	spin_unlock(&e1000_lock);
+	tx_unpin(unpin, nunpin);
+	spin_unlock(&pmap_lock);
+	return nframes;
 }
 
-int e1000_receive(char* data, int* len) {
+// Take the next packet off the receive ring.  Called with e1000_lock
+// held.
+static int
+rx_take(char* data, int* len) {
 
 	uint32_t rdt = (e1000[E1000_RDT] + 1) % E1000_RXDESC;		
-	if (!(rx_queue[rdt].status & E1000_RXD_STAT_DD)) return -E_NO_FREE;
+	int n, r;
+
+	if (nm_pgdir)
+		return -E_BUSY;
+	if (!(rx_queue[rdt].status & E1000_RXD_STAT_DD))
+		return -E_NO_FREE;
 
-	*len = rx_queue[rdt].length;
-	memmove(data, rx_pkt_bufs[rdt].pkt, *len);
+	// data and len are the caller's; on a fault the packet stays put.
+	n = rx_queue[rdt].length;
+	if ((r = user_copy_out(data, (char *) page2kva(rx_pages[rdt]) +
+			       NET_RXPAGE_DATA, n)) < 0 ||
+	    (r = user_copy_out(len, &n, sizeof(n))) < 0)
+		return r;
 
 	//reset DD bit
 	rx_queue[rdt].status &= ~E1000_RXD_STAT_DD;
@@ -111,3 +339,387 @@ int e1000_receive(char* data, int* len) {
 	
 	return 0;
 }
+
+int e1000_receive(char* data, int* len) {
+	int r;
+
+	spin_lock(&e1000_lock);
+	r = rx_take(data, len);
+	spin_unlock(&e1000_lock);
+	return r;
+}
+
+// The receive ring is empty: put curenv to sleep until the next
+// receive interrupt.  Its system call then returns -E_NO_FREE, and
+// should be made again to pick up the packet.  Only one environment
+// can wait at a time; others get -E_NO_FREE right away.  Called with
+// e1000_lock held, which this releases.
+static int
+rx_wait(void)
+{
+	if (rx_waiter) {
+		spin_unlock(&e1000_lock);
+		return -E_NO_FREE;
+	}
+	rx_waiter = curenv;
+	curenv->env_tf.tf_regs.reg_eax = -E_NO_FREE;
+	// A packet that came in since the ring was checked has already
+	// set a cause bit, so this raises the interrupt right away.
+	e1000[E1000_IMS] = E1000_ICR_RX;
+	sched_block(&e1000_lock);
+}
+
+// Like e1000_receive, but if the ring is empty, sleep (see rx_wait).
+int
+e1000_receive_wait(char* data, int* len)
+{
+	int r;
+
+	spin_lock(&e1000_lock);
+	if ((r = rx_take(data, len)) == -E_NO_FREE)
+		return rx_wait();
+	spin_unlock(&e1000_lock);
+	return r;
+}
+
+// Copy received frames into the page b, packed as a struct NetBatch,
+// taking up to NET_BATCH_MAX off the ring and writing RDT once.  Stops
+// at a frame longer than maxcopy, which is left in the ring for
+// e1000_receive_page.  Returns the number of frames copied, which is 0
+// only if the first frame is too long, -E_NO_FREE after sleeping as
+// e1000_receive_wait does, or -E_FAULT if b stopped being writable, in
+// which case the frames stay in the ring.
+int
+e1000_receive_batch(struct NetBatch *b, int maxcopy)
+{
+	struct NetBatch kb;
+	uint32_t first, rdt, next;
+	uint32_t off = sizeof(*b);
+	int i, n = 0;
+	uint16_t len;
+
+	spin_lock(&e1000_lock);
+	if (nm_pgdir) {
+		spin_unlock(&e1000_lock);
+		return -E_BUSY;
+	}
+	first = rdt = e1000[E1000_RDT];
+	while (n < NET_BATCH_MAX) {
+		next = (rdt + 1) % E1000_RXDESC;
+		if (!(rx_queue[next].status & E1000_RXD_STAT_DD)) {
+			if (n == 0)
+				return rx_wait();
+			break;
+		}
+		len = rx_queue[next].length;
+		if (len > maxcopy || off + len > PGSIZE)
+			break;
+		if (user_copy_out((char *) b + off, (char *) page2kva(
+					  rx_pages[next]) + NET_RXPAGE_DATA,
+				  len) < 0)
+			goto fault;
+		kb.nb_frames[n].nbf_off = off;
+		kb.nb_frames[n].nbf_len = len;
+		n++;
+		off = ROUNDUP(off + len, 4);
+		rdt = next;
+	}
+	kb.nb_count = n;
+	if (user_copy_out(b, &kb, sizeof(kb)) < 0)
+		goto fault;
+	// Only now that b is complete do the frames leave the ring.
+	for (i = 0; i < n; i++) {
+		next = (first + 1 + i) % E1000_RXDESC;
+		rx_queue[next].status &= ~(E1000_RXD_STAT_DD | E1000_RXD_STAT_EOP);
+	}
+	if (n > 0)
+		e1000[E1000_RDT] = rdt;
+	spin_unlock(&e1000_lock);
+	return n;
+
+fault:
+	spin_unlock(&e1000_lock);
+	return -E_FAULT;
+}
+
+// Find a page of rx_pool that is in neither the ring nor any address
+// space, and take the ring's reference on it.  Called with pmap_lock
+// held.
+static struct PageInfo *
+rx_pool_get(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	for (i = 0; i < E1000_RXPOOL; i++) {
+		pp = rx_pool[rx_pool_next];
+		rx_pool_next = (rx_pool_next + 1) % E1000_RXPOOL;
+		if (pp->pp_ref == 1) {
+			pp->pp_ref++;
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+// Like e1000_receive_wait, but instead of copying the packet, map the
+// page it was received into at va in curenv's address space, writable,
+// and put a page from the pool in the ring in its place.  The frame
+// starts NET_RXPAGE_DATA bytes into the page.  Whatever was mapped at
+// va is unmapped, even if no packet is mapped there.  Returns the
+// frame's length, -E_NO_FREE after sleeping as e1000_receive_wait does,
+// or -E_NO_MEM if a page table could not be allocated or every page of
+// the pool is still mapped somewhere, in which case the packet stays in
+// the ring, or -E_INVAL if va is inside a 4MB page.
+int
+e1000_receive_page(void *va)
+{
+	struct PageInfo *pp, *fresh;
+	uint32_t rdt;
+	pte_t *pte;
+	int len;
+
+	// Everything that can allocate or free memory happens first, as
+	// page_lock ranks below e1000_lock.
+	spin_lock(&pmap_lock);
+	if (!(pte = pgdir_walk(curenv->env_pgdir, va, 1))) {
+		spin_unlock(&pmap_lock);
+		return -E_NO_MEM;
+	}
+	if (*pte & PTE_PS) {
+		spin_unlock(&pmap_lock);
+		return -E_INVAL;
+	}
+	page_remove(curenv->env_pgdir, va);
+	if (!(fresh = rx_pool_get())) {
+		spin_unlock(&pmap_lock);
+		return -E_NO_MEM;
+	}
+
+	spin_lock(&e1000_lock);
+	if (nm_pgdir) {
+		spin_unlock(&e1000_lock);
+		fresh->pp_ref--;
+		spin_unlock(&pmap_lock);
+		return -E_BUSY;
+	}
+	rdt = (e1000[E1000_RDT] + 1) % E1000_RXDESC;
+	if (!(rx_queue[rdt].status & E1000_RXD_STAT_DD)) {
+		fresh->pp_ref--;
+		spin_unlock(&pmap_lock);
+		return rx_wait();
+	}
+	pp = rx_pages[rdt];
+	len = rx_queue[rdt].length;
+	rx_pages[rdt] = fresh;
+	rx_queue[rdt].addr = page2pa(fresh) + NET_RXPAGE_DATA;
+	rx_queue[rdt].status &= ~(E1000_RXD_STAT_DD | E1000_RXD_STAT_EOP);
+	e1000[E1000_RDT] = rdt;
+	spin_unlock(&e1000_lock);
+
+	// The ring's reference on pp becomes the mapping's.
+	*pte = page2pa(pp) | PTE_P | PTE_U | PTE_W;
+	spin_unlock(&pmap_lock);
+	return len;
+}
+
+// The page e1000_map maps k pages into the region, and its permissions.
+// The control page comes first, then the page holding both descriptor
+// rings, read-only, the page of each receive descriptor, and the
+// transmit buffers, as struct NetMap describes.
+static struct PageInfo *
+nm_map_page(int k, int *perm)
+{
+	*perm = PTE_P | PTE_U | PTE_W;
+	if (k == 0)
+		return nm_page;
+	if (k == 1) {
+		*perm = PTE_P | PTE_U;
+		return pa2page(PADDR(tx_queue));
+	}
+	if (k < 2 + E1000_RXDESC)
+		return rx_pages[k - 2];
+	return pa2page(PADDR(pkt_bufs)) + (k - 2 - E1000_RXDESC);
+}
+
+// Map the rings into curenv's address space at va (see nm_map_page).
+// The mappings stay private to that address space: fork leaves them
+// out of the child, and sys_page_map and IPC refuse to pass them on,
+// so that nobody keeps the NIC's pages once the rings go back to the
+// driver.  From then on the environment fills and drains the rings
+// itself and enters the kernel only through e1000_sync.  Returns
+// E1000_MAPSIZE, -E_BUSY if the rings are already mapped, or -E_NO_MEM
+// if a page table could not be allocated.
+int
+e1000_map(void *va)
+{
+	struct PageInfo *pp;
+	int k, perm, r = 0;
+
+	spin_lock(&pmap_lock);
+	if (!nm_page) {
+		// Allocated once and never freed, so the kernel can always
+		// look at it, whatever the environment does to its mapping.
+		if (!(nm_page = page_alloc(ALLOC_ZERO))) {
+			spin_unlock(&pmap_lock);
+			return -E_NO_MEM;
+		}
+		nm_page->pp_ref = 1;
+		nm = page2kva(nm_page);
+	}
+
+	spin_lock(&e1000_lock);
+	if (nm_pgdir) {
+		spin_unlock(&e1000_lock);
+		spin_unlock(&pmap_lock);
+		return -E_BUSY;
+	}
+	// Descriptors already queued or filled by the old calls carry
+	// over: the environment starts where the hardware is.
+	memset(nm, 0, PGSIZE);
+	nm->nm_ntx = E1000_TXDESC;
+	nm->nm_nrx = E1000_RXDESC;
+	nm->nm_txring = PGSIZE;
+	nm->nm_rxring = PGSIZE + (uintptr_t) rx_queue - (uintptr_t) tx_queue;
+	nm->nm_rxbuf = 2 * PGSIZE;
+	nm->nm_txbuf = (2 + E1000_RXDESC) * PGSIZE;
+	nm->nm_txbuf_size = sizeof(struct packet);
+	nm->nm_tx_cur = nm->nm_tx_head = e1000[E1000_TDT];
+	nm->nm_rx_head = (e1000[E1000_RDT] + 1) % E1000_RXDESC;
+	nm_pgdir = curenv->env_pgdir;
+	nm_va = (uintptr_t) va;
+	spin_unlock(&e1000_lock);
+
+	// rx_pages cannot change under us, as nm_pgdir is set.
+	for (k = 0; k < E1000_MAPSIZE / PGSIZE; k++) {
+		pp = nm_map_page(k, &perm);
+		if ((r = page_insert(nm_pgdir, pp, va + k * PGSIZE, perm)) < 0)
+			break;
+	}
+	if (r < 0) {
+		while (--k >= 0)
+			page_remove(nm_pgdir, va + k * PGSIZE);
+		spin_lock(&e1000_lock);
+		nm_pgdir = NULL;
+		spin_unlock(&e1000_lock);
+		spin_unlock(&pmap_lock);
+		return r;
+	}
+	spin_unlock(&pmap_lock);
+	return E1000_MAPSIZE;
+}
+
+// Returns true if [va, va+len) overlaps the pages e1000_map mapped
+// into pgdir.  Called with pmap_lock held.
+bool
+e1000_mapped(pde_t *pgdir, uintptr_t va, size_t len)
+{
+	return pgdir == nm_pgdir &&
+		va < nm_va + E1000_MAPSIZE && nm_va < va + len;
+}
+
+// Take the rings back from pgdir, whose last environment is being
+// freed and which maps none of the NIC's pages any more.  Called with
+// pmap_lock held.
+void
+e1000_release(pde_t *pgdir)
+{
+	spin_lock(&e1000_lock);
+	if (nm_pgdir == pgdir)
+		nm_pgdir = NULL;
+	spin_unlock(&e1000_lock);
+}
+
+// Hand the NIC the transmit slots from nm_tx_cur up to nm_tx_head, as
+// many as fit, and give back the receive slots before nm_rx_head.  If
+// wait is set and slot nm_rx_head holds no frame, sleep until one
+// comes in, returning -E_NO_FREE when it does.  Returns 0, or -E_INVAL
+// if the caller does not share the address space the rings are mapped
+// into.
+int
+e1000_sync(bool wait)
+{
+	struct PageInfo *unpin[E1000_TXDESC];
+	uint32_t tdt, rdt, head;
+	int nunpin, nfree;
+
+	spin_lock(&pmap_lock);
+	spin_lock(&e1000_lock);
+	if (!nm_pgdir || nm_pgdir != curenv->env_pgdir) {
+		spin_unlock(&e1000_lock);
+		spin_unlock(&pmap_lock);
+		return -E_INVAL;
+	}
+
+	// Frames are copied to pkt_bufs by the environment, so each slot
+	// is a whole frame.  Anything longer than TX_PKTSIZE is cut short.
+	nfree = tx_reclaim(unpin, &nunpin);
+	tdt = e1000[E1000_TDT];
+	head = nm->nm_tx_head % E1000_TXDESC;
+	if (tdt != head) {
+		for (; tdt != head && nfree > 0; nfree--) {
+			tx_queue[tdt].addr = PADDR(pkt_bufs[tdt].pkt);
+			tx_queue[tdt].length =
+				MIN(MAX(nm->nm_tx_len[tdt], 1), TX_PKTSIZE);
+			tx_queue[tdt].status &= ~E1000_TXD_STAT_DD;
+			tx_queue[tdt].cmd = E1000_TXD_CMD_RS | E1000_TXD_CMD_EOP;
+			tx_sent++;
+			tdt = (tdt + 1) % E1000_TXDESC;
+		}
+		nm->nm_tx_cur = tdt;
+		e1000[E1000_TDT] = tdt;
+	}
+
+	// A slot is only given back once the NIC has filled it, in case
+	// nm_rx_head is ahead of the frames.
+	rdt = e1000[E1000_RDT];
+	head = nm->nm_rx_head % E1000_RXDESC;
+	while ((rdt + 1) % E1000_RXDESC != head &&
+	       (rx_queue[(rdt + 1) % E1000_RXDESC].status & E1000_RXD_STAT_DD)) {
+		rdt = (rdt + 1) % E1000_RXDESC;
+		rx_queue[rdt].status &= ~(E1000_RXD_STAT_DD | E1000_RXD_STAT_EOP);
+	}
+	e1000[E1000_RDT] = rdt;
+	spin_unlock(&e1000_lock);
+	tx_unpin(unpin, nunpin);
+	spin_unlock(&pmap_lock);
+
+	if (!wait)
+		return 0;
+	spin_lock(&e1000_lock);
+	if (nm_pgdir && !(rx_queue[nm->nm_rx_head % E1000_RXDESC].status &
+			  E1000_RXD_STAT_DD))
+		return rx_wait();
+	spin_unlock(&e1000_lock);
+	return 0;
+}
+
+// Receive interrupt: mask receive interrupts again and wake the waiter.
+void
+e1000_intr(void)
+{
+	struct Env *e;
+
+	spin_lock(&e1000_lock);
+	(void) e1000[E1000_ICR];
+	e1000[E1000_IMC] = E1000_ICR_RX;
+	e = rx_waiter;
+	rx_waiter = NULL;
+	spin_unlock(&e1000_lock);
+	// The run queue lock ranks below e1000_lock.
+	if (e)
+		sched_wakeup(e);
+}
+
+// Forget e, which is being freed, if it waits for a packet.  The rings
+// stay mapped until its address space goes (see e1000_release).
+void
+e1000_cancel(struct Env *e)
+{
+	spin_lock(&e1000_lock);
+	if (rx_waiter == e) {
+		rx_waiter = NULL;
+		e1000[E1000_IMC] = E1000_ICR_RX;
+	}
+	spin_unlock(&e1000_lock);
+}
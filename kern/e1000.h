@@ -1,7 +1,6 @@
 #ifndef JOS_KERN_E1000_H
 #define JOS_KERN_E1000_H
 
-#endif	// JOS_KERN_E1000_H
 #include <kern/pci.h>
 #include <inc/stdio.h>
 #include <kern/pmap.h>
@@ -15,8 +14,19 @@
 #define TX_PKTSIZE 	1518
 #define RX_PKTSIZE	2048
 
+// Order of the page_alloc_order block holding the transmit buffers
+#define E1000_TXBUF_ORDER	5	// 64 * 1518 bytes
+// Receive buffers are single pages, from a pool this big
+#define E1000_RXPOOL		(2 * E1000_RXDESC)
+// Bytes of address space e1000_map takes
+#define E1000_MAPSIZE	((2 + E1000_RXDESC + (1 << E1000_TXBUF_ORDER)) * PGSIZE)
+
 // MMIO E1000 registers, divided by 4 for use as uint32_t[] indices.
 #define E1000_STATUS   (0x00008/4)  /* Device Status - RO */
+#define E1000_ICR      (0x000C0/4)  /* Interrupt Cause Read - R/clr */
+#define E1000_ITR      (0x000C4/4)  /* Interrupt Throttling Rate - RW */
+#define E1000_IMS      (0x000D0/4)  /* Interrupt Mask Set - RW */
+#define E1000_IMC      (0x000D8/4)  /* Interrupt Mask Clear - WO */
 
 #define E1000_TCTL     (0x00400/4)  /* TX Control - RW */
 #define E1000_TCTL_EXT (0x00404/4)  /* Extended TX Control - RW */
@@ -33,9 +43,20 @@
 #define E1000_RDLEN    (0x02808/4)  /* RX Descriptor Length - RW */
 #define E1000_RDH      (0x02810/4)  /* RX Descriptor Head - RW */
 #define E1000_RDT      (0x02818/4)  /* RX Descriptor Tail - RW */
+#define E1000_RDTR     (0x02820/4)  /* RX Delay Timer - RW */
 #define E1000_RA       (0x05400/4)  /* Receive Address - RW Array */
 #define E1000_RAH_AV  0x80000000    /* Receive descriptor valid */
 
+//Interrupt cause bits, for ICR, IMS and IMC
+#define E1000_ICR_RXDMT0  0x00000010    /* rx desc min. threshold */
+#define E1000_ICR_RXO     0x00000040    /* rx overrun */
+#define E1000_ICR_RXT0    0x00000080    /* rx timer intr */
+#define E1000_ICR_RX      (E1000_ICR_RXDMT0 | E1000_ICR_RXO | E1000_ICR_RXT0)
+
+// Interrupt moderation: at most one interrupt per E1000_ITR_INTERVAL
+// units of 256ns (about 128us), which bounds the added latency.
+#define E1000_ITR_INTERVAL	500
+
 //Transmit control bits
 #define E1000_TCTL_EN     0x00000002    /* enable tx */
 #define E1000_TCTL_PSP    0x00000008    /* pad short packets */
@@ -90,11 +111,26 @@ struct packet {
 	uint8_t pkt[TX_PKTSIZE];
 };
 
-struct rx_packet {
-	uint8_t pkt[RX_PKTSIZE];
-};
+struct Env;
+struct NetFrag;
+struct NetTxSeq;
+struct NetBatch;
 
-volatile uint32_t* e1000;
+extern volatile uint32_t* e1000;
+extern uint8_t e1000_irq;
 int pci_network_attach(struct pci_func *pcif);
 int e1000_transmit(const char* msg, int len);
+int e1000_transmit_frags(const struct NetFrag *frags, int nfrags,
+			 struct NetTxSeq *seq);
 int e1000_receive(char* msg, int* len);
+int e1000_receive_wait(char* msg, int* len);
+int e1000_receive_page(void *va);
+int e1000_receive_batch(struct NetBatch *b, int maxcopy);
+int e1000_map(void *va);
+bool e1000_mapped(pde_t *pgdir, uintptr_t va, size_t len);
+void e1000_release(pde_t *pgdir);
+int e1000_sync(bool wait);
+void e1000_intr(void);
+void e1000_cancel(struct Env *e);
+
+#endif	// JOS_KERN_E1000_H
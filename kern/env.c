@@ -14,11 +14,21 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/time.h>
+#include <kern/e1000.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
+// env_lock protects env_free_list and the transition of an Env to
+// ENV_FREE.  Holding it across envid2env and the use of the result
+// guarantees the Env is not freed and reused in between.
+struct spinlock env_lock = SPINLOCK_INIT("env_lock", LOCK_RANK_ENV);
+
+// ipc_lock protects the env_ipc_* fields of every Env.
+struct spinlock ipc_lock = SPINLOCK_INIT("ipc_lock", LOCK_RANK_IPC);
+
 #define ENVGENSHIFT	12		// >= LOGNENV
 
 // Global descriptor table.
@@ -66,6 +76,11 @@ struct Pseudodesc gdt_pd = {
 // Converts an envid to an env pointer.
 // If checkperm is set, the specified environment must be either the
 // current environment or an immediate child of the current environment.
+// Dying environments are treated as already gone.
+//
+// Unless envid names curenv, the result is only stable while the caller
+// holds env_lock, ipc_lock (if the env is receiving), or pmap_lock (for
+// its address space); env_free takes each of them in turn.
 //
 // RETURNS
 //   0 on success, -E_BAD_ENV on error.
@@ -89,7 +104,8 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
 	e = &envs[ENVX(envid)];
-	if (e->env_status == ENV_FREE || e->env_id != envid) {
+	if (e->env_status == ENV_FREE || e->env_status == ENV_DYING
+	    || e->env_id != envid) {
 		*env_store = 0;
 		return -E_BAD_ENV;
 	}
@@ -205,6 +221,8 @@ env_setup_vm(struct Env *e)
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
+// It starts out ENV_NOT_RUNNABLE, so that no CPU picks it up before
+// the caller has finished setting it up.
 //
 // Returns 0 on success, < 0 on failure.  Errors include:
 //	-E_NO_FREE_ENV if all NENVS environments are allocated
@@ -217,12 +235,22 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_lock);
 		return -E_NO_FREE_ENV;
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_lock);
 
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_lock(&env_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_lock);
 		return r;
+	}
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -233,8 +261,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->env_priority = ENV_PRIO_NORMAL;
+	e->env_vruntime = 0;
+	e->env_runtime = 0;
+	e->env_timeout = 0;
+	e->env_futex_pa = 0;
+	e->env_ipc_donations = 0;
+	e->env_ipc_donated = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -263,12 +297,17 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_uxstacktop = UXSTACKTOP;
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag and the sender queue.
 	e->env_ipc_recving = 0;
+	e->env_ipc_sendq_head = e->env_ipc_sendq_tail = NULL;
+	e->env_ipc_send_to = NULL;
+	e->env_ipc_callee = NULL;
+	e->env_ipc_callers = NULL;
 
-	// commit the allocation
-	env_free_list = e->env_link;
+	// commit the allocation; the caller makes it runnable when ready
+	e->env_status = ENV_NOT_RUNNABLE;
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -293,7 +332,7 @@ region_alloc(struct Env *e, void *va, size_t len)
 	uint32_t start = bottom;
 
 	for(; top > bottom; bottom += PGSIZE) {
-		if( NULL == (p = page_alloc(false))) panic("Out of Memory : region alloc");
+		if( NULL == (p = page_alloc(ALLOC_ZERO))) panic("Out of Memory : region alloc");
 		page_insert(e->env_pgdir, p, (void *) bottom, PTE_W | PTE_U | PTE_P);
 	}
 	//
@@ -363,7 +402,7 @@ load_icode(struct Env *e, uint8_t *binary)
 
 	// load each program segment (ignores ph flags)
 	struct Proghdr* ph = (struct Proghdr *) ((uint8_t *) ELFHDR + ELFHDR->e_phoff);
-	lcr3(PADDR(e->env_pgdir));
+	pgdir_switch(e->env_pgdir);
 	struct Proghdr* eph = ph + ELFHDR->e_phnum;
 	for (; ph < eph; ph++){
 		// p_pa is the load address of this segment (as well as the physical address)
@@ -380,7 +419,7 @@ load_icode(struct Env *e, uint8_t *binary)
 	// note: does not return!
 	e->env_tf.tf_eip = ELFHDR->e_entry;
 
-	lcr3(PADDR(kern_pgdir));
+	pgdir_switch(kern_pgdir);
 	// Now map one page for the program's initial stack
 	// at virtual address USTACKTOP - PGSIZE.
 	
@@ -407,10 +446,165 @@ env_create(uint8_t *binary, enum EnvType type)
 	// If this is the file server (type == ENV_TYPE_FS) give it I/O privileges.
 	// LAB 5: Your code here.
 	if( type == ENV_TYPE_FS ) e->env_tf.tf_eflags = e->env_tf.tf_eflags | FL_IOPL_MASK;
+
+	// The servers, and the helpers the network server forks, get a
+	// real-time priority so that user jobs cannot hold up disk and
+	// packet processing.
+	if (type == ENV_TYPE_FS || type == ENV_TYPE_NS)
+		e->env_priority = ENV_PRIO_SERVER;
+
+	sched_wakeup(e);
+}
+
+//
+// Create a child of 'parent' that shares its memory copy-on-write (see
+// pgdir_copy_cow), for SYS_fork.  The child is left ENV_NOT_RUNNABLE,
+// set up to return 0 from the system call.  On success, the new
+// environment is stored in *newenv_store.
+//
+// Returns 0 on success, < 0 on failure.  Errors include:
+//	-E_NO_FREE_ENV if all NENV environments are allocated
+//	-E_NO_MEM on memory exhaustion
+//
+int
+env_fork(struct Env *parent, struct Env **newenv_store)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = env_alloc(&e, parent->env_id)) < 0)
+		return r;
+	e->env_tf = parent->env_tf;
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_pgfault_upcall = parent->env_pgfault_upcall;
+	e->env_uxstacktop = parent->env_uxstacktop;
+	e->env_priority = parent->env_priority;
+	e->env_vruntime = parent->env_vruntime;
+
+	spin_lock(&pmap_lock);
+	r = pgdir_copy_cow(e->env_pgdir, parent->env_pgdir,
+			   parent->env_uxstacktop);
+	spin_unlock(&pmap_lock);
+	if (r < 0) {
+		env_free(e);
+		return r;
+	}
+	*newenv_store = e;
+	return 0;
+}
+
+//
+// Create a thread of 'parent' for SYS_sfork: a new environment that
+// shares parent's page directory, and so all of its memory.  The child
+// is left ENV_NOT_RUNNABLE, set up to start at 'eip' with its stack
+// pointer at 'esp' and every other register zero; the caller must have
+// built whatever stack frame the code at eip expects.  Its exception
+// stack ends at 'xstacktop'.  On success, the new environment is
+// stored in *newenv_store.
+//
+// Returns 0 on success, < 0 on failure.  Errors include:
+//	-E_NO_FREE_ENV if all NENV environments are allocated
+//	-E_INVAL if eip or esp is above UTOP, or xstacktop is misaligned
+//		or above UTOP
+//
+int
+env_sfork(struct Env *parent, uintptr_t eip, uintptr_t esp,
+	  uintptr_t xstacktop, struct Env **newenv_store)
+{
+	struct Env *e;
+	int r;
+
+	if (eip >= UTOP || esp > UTOP ||
+	    xstacktop % PGSIZE || xstacktop > UTOP)
+		return -E_INVAL;
+	if ((r = env_alloc(&e, parent->env_id)) < 0)
+		return r;
+
+	spin_lock(&pmap_lock);
+	page_decref(pa2page(PADDR(e->env_pgdir)));
+	e->env_pgdir = parent->env_pgdir;
+	pa2page(PADDR(e->env_pgdir))->pp_ref++;
+	spin_unlock(&pmap_lock);
+
+	e->env_tf.tf_eip = eip;
+	e->env_tf.tf_esp = esp;
+	e->env_pgfault_upcall = parent->env_pgfault_upcall;
+	e->env_uxstacktop = xstacktop;
+	e->env_priority = parent->env_priority;
+	e->env_vruntime = parent->env_vruntime;
+	*newenv_store = e;
+	return 0;
+}
+
+//
+// Make e accept a reply only from callee, or from anyone if callee is
+// NULL, keeping e on callee's list of callers so that they can be
+// failed if callee goes away.
+// Called with ipc_lock held.
+//
+void
+env_ipc_set_callee(struct Env *e, struct Env *callee)
+{
+	struct Env **pp;
+
+	if (e->env_ipc_callee) {
+		for (pp = &e->env_ipc_callee->env_ipc_callers; *pp != e;
+		     pp = &(*pp)->env_ipc_caller_link)
+			;
+		*pp = e->env_ipc_caller_link;
+	}
+	e->env_ipc_callee = callee;
+	if (callee) {
+		e->env_ipc_caller_link = callee->env_ipc_callers;
+		callee->env_ipc_callers = e;
+	}
+}
+
+//
+// Take e off the sender queue it is blocked on, if any, and fail
+// every sender blocked on e, and every caller still waiting for e's
+// reply, with -E_BAD_ENV.
+// Called with ipc_lock held.
+//
+static void
+env_ipc_detach(struct Env *e)
+{
+	struct Env *dst, **pp, *prev, *s;
+
+	if ((dst = e->env_ipc_send_to) != NULL) {
+		prev = NULL;
+		for (pp = &dst->env_ipc_sendq_head; *pp != e;
+		     pp = &(*pp)->env_ipc_send_link)
+			prev = *pp;
+		*pp = e->env_ipc_send_link;
+		if (dst->env_ipc_sendq_tail == e)
+			dst->env_ipc_sendq_tail = prev;
+		e->env_ipc_send_to = NULL;
+	}
+
+	while ((s = e->env_ipc_sendq_head) != NULL) {
+		e->env_ipc_sendq_head = s->env_ipc_send_link;
+		s->env_ipc_send_to = NULL;
+		if (s->env_ipc_send_call)
+			continue;	// failed below, as a caller of e
+		s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		sched_wakeup(s);
+	}
+	e->env_ipc_sendq_tail = NULL;
+
+	env_ipc_set_callee(e, NULL);
+	while ((s = e->env_ipc_callers) != NULL) {
+		env_ipc_set_callee(s, NULL);
+		s->env_ipc_recving = false;
+		s->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		sched_wakeup(s);
+	}
 }
 
 //
 // Frees env e and all memory it uses.
+// e must be ENV_DYING, and the caller must be the one CPU that moved
+// it there or found it there as curenv (see env_mark_dying).
 //
 void
 env_free(struct Env *e)
@@ -418,28 +612,54 @@ env_free(struct Env *e)
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
+	bool last;
 
 	// If freeing the current environment, switch to kern_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
 	if (e == curenv)
-		lcr3(PADDR(kern_pgdir));
+		pgdir_switch(kern_pgdir);
 
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
+	// Stop senders from mapping pages into e while we tear it down,
+	// and make sure no receiver looks at e's pages either.
+	spin_lock(&ipc_lock);
+	e->env_ipc_recving = 0;
+	env_ipc_detach(e);
+	spin_unlock(&ipc_lock);
+	time_cancel(e);
+	e1000_cancel(e);
+
+	// Flush all mapped pages in the user portion of the address space,
+	// unless threads made by sfork still share it
 	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+	spin_lock(&pmap_lock);
+	last = pa2page(PADDR(e->env_pgdir))->pp_ref == 1;
+	for (pdeno = 0; last && pdeno < PDX(UTOP); pdeno++) {
 
 		// only look at mapped page tables
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a 4MB page has no page table
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			page_remove(e->env_pgdir, PGADDR(pdeno, 0, 0));
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
 
+		// a page table still shared after fork just loses a reference
+		if ((e->env_pgdir[pdeno] & PTE_COW) && pa2page(pa)->pp_ref > 1) {
+			e->env_pgdir[pdeno] = 0;
+			page_decref(pa2page(pa));
+			continue;
+		}
+
 		// unmap all PTEs in this page table
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
 			if (pt[pteno] & PTE_P)
@@ -451,15 +671,68 @@ env_free(struct Env *e)
 		page_decref(pa2page(pa));
 	}
 
+	// The NIC's pages are unmapped now, if e had them (see e1000_map)
+	if (last)
+		e1000_release(e->env_pgdir);
+
 	// free the page directory
 	pa = PADDR(e->env_pgdir);
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
+	spin_unlock(&pmap_lock);
 
-	// return the environment to the free list
+	// Return the environment to the free list, unless a stale entry
+	// for it is still on a run queue: the slot must not be reused
+	// while it sits in a fair heap, so runq_pop recycles it instead
+	// once the entry is gone.
+	spin_lock(&env_lock);
 	e->env_status = ENV_FREE;
+	spin_unlock(&env_lock);
+	if (xchg(&e->env_rq_queued, ENV_RQ_FREED) == ENV_RQ_NONE)
+		env_recycle(e);
+}
+
+//
+// Put e, which is ENV_FREE and on no run queue, back on the free list.
+//
+void
+env_recycle(struct Env *e)
+{
+	spin_lock(&env_lock);
+	e->env_rq_queued = ENV_RQ_NONE;
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_lock);
+}
+
+//
+// Mark e, which is not curenv, as dying.
+// Returns true if the caller now owns e and must env_free it.
+// Returns false if e is running on another CPU, which will free it
+// the next time it enters the kernel, or if e is already on its way out.
+// The caller holds env_lock, so e cannot be freed and reused under it.
+//
+bool
+env_mark_dying(struct Env *e)
+{
+	uint32_t status;
+
+	while (1) {
+		status = e->env_status;
+		switch (status) {
+		case ENV_RUNNING:
+			if (cmpxchg(&e->env_status, status, ENV_DYING) == status)
+				return false;
+			break;
+		case ENV_RUNNABLE:
+		case ENV_NOT_RUNNABLE:
+			if (cmpxchg(&e->env_status, status, ENV_DYING) == status)
+				return true;
+			break;
+		default:
+			return false;
+		}
+	}
 }
 
 //
@@ -470,22 +743,26 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
-	// If e is currently running on other CPUs, we change its state to
-	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
-		return;
-	}
-
-	env_free(e);
+	bool own;
 
-	if (curenv == e) {
+	if (e == curenv) {
+		// No other CPU may tear down curenv, but it may already
+		// have marked it dying; either way it is ours to free.
+		xchg(&e->env_status, ENV_DYING);
+		env_free(e);
 		curenv = NULL;
 		sched_yield();
 	}
-}
 
+	// If e is currently running on other CPUs, we change its state to
+	// ENV_DYING. A zombie environment will be freed the next time
+	// it traps to the kernel.
+	spin_lock(&env_lock);
+	own = env_mark_dying(e);
+	spin_unlock(&env_lock);
+	if (own)
+		env_free(e);
+}
 
 //
 // Restores the register values in the Trapframe with the 'iret' instruction.
@@ -536,13 +813,33 @@ env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-	if (curenv != NULL && curenv->env_status == ENV_RUNNING ) curenv->env_status = ENV_RUNNABLE;
+	//
+	// e is already ENV_RUNNING: either it is curenv, or the
+	// scheduler claimed it for this CPU.  Switch away from the old
+	// environment before handing it back, since another CPU may
+	// pick it up (or free it) as soon as it is queued.
+	struct Env *prev = curenv;
+
+	sched_charge();
+	if (thiscpu->cpu_tickless) {
+		// Coming out of idle: start ticking again.
+		thiscpu->cpu_tickless = false;
+		time_arm(true);
+	}
 	curenv = e;
-	curenv->env_status = ENV_RUNNING;
 	curenv->env_runs++;
-	lcr3(PADDR(curenv->env_pgdir));	
+	pgdir_switch(curenv->env_pgdir);
+
+	if (prev != NULL && prev != e) {
+		if (cmpxchg(&prev->env_status, ENV_RUNNING, ENV_RUNNABLE)
+		    == ENV_RUNNING)
+			sched_enqueue(prev);
+		else if (prev->env_status == ENV_DYING)
+			env_free(prev);
+	}
 
-	unlock_kernel();		
+	spin_assert_none_held();
+	tlb_shootdown();
 	env_pop_tf(&e->env_tf);
 }
 
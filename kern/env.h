@@ -7,6 +7,8 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
+extern struct spinlock env_lock;	// Env table and free list
+extern struct spinlock ipc_lock;	// IPC state of every environment
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
@@ -14,8 +16,14 @@ void	env_init(void);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
+void	env_recycle(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
+int	env_fork(struct Env *parent, struct Env **newenv_store);
+int	env_sfork(struct Env *parent, uintptr_t eip, uintptr_t esp,
+		  uintptr_t xstacktop, struct Env **newenv_store);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+bool	env_mark_dying(struct Env *e);
+void	env_ipc_set_callee(struct Env *e, struct Env *callee);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
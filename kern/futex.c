@@ -0,0 +1,170 @@
+#include <inc/error.h>
+#include <inc/memlayout.h>
+
+#include <kern/futex.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/time.h>
+
+// Environments blocked in futex_wait, hashed by the physical page of
+// the word they wait on, so that a futex in a page shared between
+// address spaces is the same futex in all of them, and so that
+// futex_wake_page finds all the waiters in a page in one queue.  New
+// waiters join a queue only with pmap_lock held.  The queues are
+// protected by timer_lock, which lets a waiter with a timeout sit on
+// both its futex queue and the sleep queue, and whichever of
+// futex_wake and time_expire gets to it first takes it off the other.
+
+#define NFUTEXQ		64
+
+static struct Env *futexq[NFUTEXQ];	// Oldest waiter first
+
+static struct Env **
+futex_bucket(physaddr_t pa)
+{
+	return &futexq[PGNUM(pa) % NFUTEXQ];
+}
+
+// Find the physical address of the word at user address 'addr' in
+// curenv.  A copy-on-write page is copied first, so that writing the
+// word does not move it away from its waiters.  Called with pmap_lock
+// held.
+static int
+futex_key(const uint32_t *addr, physaddr_t *pa_store)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r;
+
+	if ((uintptr_t) addr >= UTOP || (uintptr_t) addr % 4)
+		return -E_INVAL;
+	if (!(pp = page_lookup(curenv->env_pgdir, (void *) addr, &pte)) ||
+	    !(*pte & PTE_U))
+		return -E_FAULT;
+	if (!(*pte & curenv->env_pgdir[PDX(addr)] & PTE_W)) {
+		if ((r = page_cow_fault(curenv->env_pgdir, (void *) addr)) == -E_NO_MEM)
+			return r;
+		pp = page_lookup(curenv->env_pgdir, (void *) addr, NULL);
+	}
+	*pa_store = page2pa(pp) + PGOFF(addr);
+	return 0;
+}
+
+// Block curenv until futex_wake is called on the word at 'addr', if
+// that word still holds 'val', giving up after 'usec' microseconds
+// unless usec is 0.  Its system call then returns 0 if it was woken,
+// or -E_TIMEOUT.  Returns 0 right away if the word holds something
+// else, and < 0 on error.
+int
+futex_wait(const uint32_t *addr, uint32_t val, uint32_t usec)
+{
+	struct Env **pp;
+	physaddr_t pa;
+	int r;
+
+	spin_lock(&pmap_lock);
+	if ((r = futex_key(addr, &pa)) < 0) {
+		spin_unlock(&pmap_lock);
+		return r;
+	}
+	// A waker changes the word before it takes timer_lock, so it
+	// cannot slip in between this check and our going to sleep.
+	spin_lock(&timer_lock);
+	if (*addr != val) {
+		spin_unlock(&timer_lock);
+		spin_unlock(&pmap_lock);
+		return 0;
+	}
+
+	for (pp = futex_bucket(pa); *pp; pp = &(*pp)->env_futex_link)
+		;
+	*pp = curenv;
+	curenv->env_futex_link = NULL;
+	curenv->env_futex_pa = pa;
+	spin_unlock(&pmap_lock);
+	curenv->env_tf.tf_regs.reg_eax = usec ? -E_TIMEOUT : 0;
+	if (usec)
+		time_enqueue(curenv, usec);
+	sched_block(&timer_lock);
+}
+
+// Wake up to n environments waiting on a word whose physical address
+// is 'pa' once masked with 'mask', oldest first.  Called with
+// timer_lock held.  Returns the number woken.
+static int
+futex_wake_masked(physaddr_t pa, physaddr_t mask, int n)
+{
+	struct Env *e, **pp;
+	int woken = 0;
+
+	pp = futex_bucket(pa);
+	while ((e = *pp) != NULL && woken < n) {
+		if ((e->env_futex_pa & mask) != pa) {
+			pp = &e->env_futex_link;
+			continue;
+		}
+		*pp = e->env_futex_link;
+		e->env_futex_link = NULL;
+		e->env_futex_pa = 0;
+		time_dequeue(e);
+		e->env_tf.tf_regs.reg_eax = 0;
+		sched_wakeup(e);
+		woken++;
+	}
+	return woken;
+}
+
+// Wake up to n environments waiting on the word at 'addr', oldest
+// first.  Returns the number woken, or < 0 on error.
+int
+futex_wake(const uint32_t *addr, int n)
+{
+	physaddr_t pa;
+	int r;
+
+	spin_lock(&pmap_lock);
+	r = futex_key(addr, &pa);
+	spin_unlock(&pmap_lock);
+	if (r < 0)
+		return r;
+
+	spin_lock(&timer_lock);
+	r = futex_wake_masked(pa, ~0, n);
+	spin_unlock(&timer_lock);
+	return r;
+}
+
+// Wake every environment waiting on a futex in the page at 'pa', which
+// has just been unmapped from some address space.  The waiters may be
+// watching for that, as pipes do to notice that the other end closed.
+// Called with pmap_lock held, so no waiter can join the queue between
+// our look at it and the unmap.
+void
+futex_wake_page(physaddr_t pa)
+{
+	// Almost always nobody waits, so skip timer_lock then.
+	if (!*futex_bucket(pa))
+		return;
+	spin_lock(&timer_lock);
+	futex_wake_masked(ROUNDDOWN(pa, PGSIZE), ~(PGSIZE - 1), NENV);
+	spin_unlock(&timer_lock);
+}
+
+// Take e off its futex wait queue, if it is on one.  Called with
+// timer_lock held.
+void
+futex_cancel(struct Env *e)
+{
+	struct Env **pp;
+
+	if (!e->env_futex_pa)
+		return;
+	for (pp = futex_bucket(e->env_futex_pa); *pp != e;
+	     pp = &(*pp)->env_futex_link)
+		;
+	*pp = e->env_futex_link;
+	e->env_futex_link = NULL;
+	e->env_futex_pa = 0;
+}
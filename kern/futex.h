@@ -0,0 +1,16 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+int futex_wait(const uint32_t *addr, uint32_t val, uint32_t usec);
+int futex_wake(const uint32_t *addr, int n);
+void futex_wake_page(physaddr_t pa);
+void futex_cancel(struct Env *e);
+
+#endif /* JOS_KERN_FUTEX_H */
@@ -44,6 +44,7 @@ i386_init(void)
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
 	lapic_init();
+	sched_init();
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
@@ -52,13 +53,6 @@ i386_init(void)
 	time_init();
 	pci_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	lock_kernel();
-
-	// Starting non-boot CPUs
-	boot_aps();
-
 	// Start fs.
 	ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
@@ -78,6 +72,10 @@ i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+	// Starting non-boot CPUs.  The initial environments exist by now,
+	// so the APs find work to steal instead of declaring the system idle.
+	boot_aps();
+
 	// Schedule and run the first user environment!
 	sched_yield();
 }
@@ -125,7 +123,12 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir for that AP to use(shared by all AP's)
-	lcr3(PADDR(kern_pgdir));
+	// kern_pgdir may use 4MB and global pages, so turn them on first.
+	if (page_pse)
+		lcr4(rcr4() | CR4_PSE);
+	if (page_pge)
+		lcr4(rcr4() | CR4_PGE);
+	pgdir_switch(kern_pgdir);
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
@@ -134,11 +137,7 @@ mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
-	lock_kernel();
+	// to start running processes on this CPU.
 	sched_yield();
 
 	// Remove this after you finish Exercise 4
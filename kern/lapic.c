@@ -9,6 +9,8 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/sched.h>
+#include <kern/time.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -42,8 +44,17 @@
 #define TCCR    (0x0390/4)   // Timer Current Count
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
+// 8253/8254 programmable interval timer, used as the reference clock
+// for calibration.  Channel 2's gate and output are in port 0x61.
+#define PIT_HZ		1193182
+#define PIT_CH2		0x42
+#define PIT_MODE	0x43
+#define PIT_GATE	0x61
+#define CALIBRATE_MS	10
+
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
+static uint32_t lapic_hz;    // Timer count rate, measured at boot
 
 static void
 lapicw(int index, int value)
@@ -52,6 +63,54 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// Measure the LAPIC timer and TSC rates against CALIBRATE_MS of PIT
+// channel 2.  The rates are the same on every CPU, so the boot CPU
+// does this once for all of them.
+static void
+lapic_calibrate(void)
+{
+	uint16_t latch = PIT_HZ / (1000 / CALIBRATE_MS);
+	uint64_t tsc0, tsc1;
+	uint32_t count;
+
+	// Gate channel 2 on, speaker off; mode 0 counts down once.
+	outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+	outb(PIT_MODE, 0xB0);
+	outb(PIT_CH2, latch & 0xff);
+	outb(PIT_CH2, latch >> 8);
+
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0xffffffff);
+	tsc0 = read_tsc();
+	while (!(inb(PIT_GATE) & 0x20))
+		;
+	tsc1 = read_tsc();
+	count = 0xffffffff - lapic[TCCR];
+	lapicw(TICR, 0);
+
+	lapic_hz = count * (1000 / CALIBRATE_MS);
+	time_calibrate((tsc1 - tsc0) * (1000 / CALIBRATE_MS));
+	cprintf("LAPIC timer %u kHz, TSC %u kHz\n", lapic_hz / 1000,
+		(uint32_t) ((tsc1 - tsc0) / CALIBRATE_MS));
+}
+
+// Make this CPU's timer interrupt fire once, usec microseconds from
+// now, replacing any earlier deadline.  0 disarms the timer.
+void
+lapic_timer_oneshot(uint32_t usec)
+{
+	uint64_t count;
+
+	if (!lapic)
+		return;
+	count = (uint64_t) usec * lapic_hz / 1000000;
+	if (usec && count == 0)
+		count = 1;
+	if (count > 0xffffffff)
+		count = 0xffffffff;
+	lapicw(TICR, count);
+}
+
 void
 lapic_init(void)
 {
@@ -65,13 +124,14 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  Rather than tick periodically,
+	// the kernel sets each deadline as it goes (see kern/time.c).
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	if (thiscpu == bootcpu)
+		lapic_calibrate();
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapic_timer_oneshot(SCHED_QUANTUM_USEC);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -173,6 +233,16 @@ lapic_startap(uint8_t apicid, uint32_t addr)
 	}
 }
 
+// Send an interrupt to the CPU with the given local APIC ID.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
 void
 lapic_ipi(int vector)
 {
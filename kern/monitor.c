@@ -11,6 +11,9 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/spinlock.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -26,6 +29,10 @@ static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 	{ "backtrace", "Display Backtrace", mon_backtrace },
+	{ "lockstat", "Display the most contended spinlocks [count]", mon_lockstat },
+	{ "ipcstat", "Display IPC time slice donations per environment", mon_ipcstat },
+	{ "pagestat", "Display per-CPU page allocator and TLB shootdown statistics", mon_pagestat },
+	{ "buddyinfo", "Display free physical memory blocks by order", mon_buddyinfo },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -86,6 +93,48 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 	return count;
 }
 
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	int n = 10;
+
+	if (argc > 1)
+		n = strtol(argv[1], 0, 0);
+	spin_print_stats(n);
+	return 0;
+}
+
+int
+mon_pagestat(int argc, char **argv, struct Trapframe *tf)
+{
+	page_print_stats();
+	return 0;
+}
+
+int
+mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	page_print_buddy();
+	return 0;
+}
+
+int
+mon_ipcstat(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+
+	cprintf("env       runs      donated-to  donated-by\n");
+	for (e = envs; e < envs + NENV; e++) {
+		if (e->env_status == ENV_FREE)
+			continue;
+		if (!e->env_ipc_donations && !e->env_ipc_donated)
+			continue;
+		cprintf("%08x  %-8u  %-10u  %u\n", e->env_id, e->env_runs,
+			e->env_ipc_donations, e->env_ipc_donated);
+	}
+	return 0;
+}
+
 
 
 /***** Kernel monitor command interpreter *****/
@@ -15,5 +15,9 @@ void monitor(struct Trapframe *tf);
 int mon_help(int argc, char **argv, struct Trapframe *tf);
 int mon_kerninfo(int argc, char **argv, struct Trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
+int mon_pagestat(int argc, char **argv, struct Trapframe *tf);
+int mon_buddyinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_ipcstat(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -10,6 +10,8 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/futex.h>
+#include <kern/e1000.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -19,6 +21,42 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
 static struct PageInfo *page_free_list;	// Free list of physical pages
+static struct PageInfo *buddy_free_area[PAGE_MAX_ORDER + 1];
+static size_t buddy_nblocks[PAGE_MAX_ORDER + 1];	// Blocks on each list
+static size_t page_nfree;		// Free pages, on either
+static struct PageInfo *page_zero_list;	// Free pages known to be zero
+static size_t page_nzero;		// Pages on page_zero_list
+
+// pmap_lock protects the user portion of every page directory and the
+// pp_ref counts; callers of page_insert, page_remove and friends on a
+// live environment hold it.  page_lock protects the free lists and is
+// taken inside page_alloc and page_free.
+//
+// Free memory starts out on page_free_list.  At the end of mem_init,
+// once the checks, which manipulate page_free_list directly, are
+// done, it all moves to a buddy allocator: buddy_free_area[k] lists
+// the free, naturally aligned blocks of 1 << k pages, and freeing a
+// block merges it with its buddy whenever that is free too.
+// page_alloc_order hands out whole blocks.
+//
+// Most page_alloc and page_free calls never take page_lock: each CPU
+// keeps a magazine of up to MAG_SIZE free pages, refilled from and
+// drained to the buddy allocator MAG_BATCH pages at a time.
+//
+// Idle CPUs move free pages to page_zero_list, zeroing them on the
+// way, so that page_alloc(ALLOC_ZERO) rarely has to; page_lock
+// protects that list too.  Each magazine caches some zeroed pages
+// separately from the rest.
+struct spinlock pmap_lock = SPINLOCK_INIT("pmap_lock", LOCK_RANK_PMAP);
+static struct spinlock page_lock = SPINLOCK_INIT("page_lock", LOCK_RANK_PAGE);
+
+#define MAG_SIZE	64
+#define MAG_BATCH	32
+#define ZERO_POOL_SIZE	1024	// Most pages idle CPUs keep zeroed
+static bool page_magazines;	// Buddy allocator and magazines in use
+
+bool page_pse;			// 4MB pages are enabled (CR4_PSE)
+bool page_pge;			// Global pages are enabled (CR4_PGE)
 
 
 // --------------------------------------------------------------
@@ -60,6 +98,7 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static void buddy_init(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
@@ -67,6 +106,8 @@ static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void page_decref_unmapped(struct PageInfo *pp);
+static uint32_t tlb_targets(pde_t *pgdir);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -123,6 +164,7 @@ void
 mem_init(void)
 {
 	uint32_t cr0;
+	uint32_t edx;
 	size_t n;
 	int i;
 
@@ -178,6 +220,20 @@ mem_init(void)
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory
 
+	// Where the processor has them, use 4MB pages (see boot_map_region);
+	// this saves a page table per 4MB and a lot of TLB entries.  And
+	// since the mappings above UTOP are the same in every address
+	// space, make them global so that lcr3 leaves them in the TLB.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_EDX_PSE) {
+		lcr4(rcr4() | CR4_PSE);
+		page_pse = true;
+	}
+	if (edx & CPUID_EDX_PGE) {
+		lcr4(rcr4() | CR4_PGE);
+		page_pge = true;
+	}
+
 	//////////////////////////////////////////////////////////////////////
 	// Map 'pages' read-only by the user at linear address UPAGES
 	// Permissions:
@@ -218,7 +274,7 @@ mem_init(void)
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
-	boot_map_region(kern_pgdir, KERNBASE, 0xffffffff - KERNBASE, 0, PTE_W); 
+	boot_map_region(kern_pgdir, KERNBASE, -KERNBASE, 0, PTE_W);
 	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
 
@@ -232,7 +288,7 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
-	lcr3(PADDR(kern_pgdir));
+	pgdir_switch(kern_pgdir);
 
 	check_page_free_list(0);
 
@@ -245,6 +301,9 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	buddy_init();
+	page_magazines = true;
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -328,7 +387,172 @@ page_init(void)
 		pages[i].pp_ref = 0;
 		pages[i].pp_link = page_free_list;
 		page_free_list = &pages[i];
+		page_nfree++;
+	}
+}
+
+// --------------------------------------------------------------
+// Buddy allocator.  All of these must be called with page_lock held.
+// --------------------------------------------------------------
+
+static void
+buddy_insert(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_free = 1;
+	pp->pp_prev = NULL;
+	pp->pp_link = buddy_free_area[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	buddy_free_area[order] = pp;
+	buddy_nblocks[order]++;
+}
+
+static void
+buddy_remove(struct PageInfo *pp)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		buddy_free_area[pp->pp_order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	buddy_nblocks[pp->pp_order]--;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_free = 0;
+}
+
+//
+// Take a block of 1 << order pages, splitting the smallest larger
+// block if there is none of that order.  Returns NULL if there is no
+// block big enough.
+//
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k <= PAGE_MAX_ORDER && !buddy_free_area[k]; k++)
+		/* do nothing */;
+	if (k > PAGE_MAX_ORDER)
+		return NULL;
+	pp = buddy_free_area[k];
+	buddy_remove(pp);
+	// Give back the upper half until the block is the right size
+	while (k > order) {
+		k--;
+		buddy_insert(pp + (1 << k), k);
+	}
+	page_nfree -= 1 << order;
+	return pp;
+}
+
+//
+// Free a block of 1 << order pages, merging it with its buddy for as
+// long as the buddy is a free block of the same order.
+//
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t i = pp - pages, b;
+
+	// pp may end up inside a bigger block rather than at its head
+	pp->pp_link = NULL;
+	page_nfree += 1 << order;
+	while (order < PAGE_MAX_ORDER) {
+		b = i ^ (1 << order);
+		if (b >= npages || !pages[b].pp_free ||
+		    pages[b].pp_order != order)
+			break;
+		buddy_remove(&pages[b]);
+		i &= ~(1 << order);
+		order++;
+	}
+	buddy_insert(&pages[i], order);
+}
+
+//
+// Move everything on page_free_list to the buddy allocator.
+//
+static void
+buddy_init(void)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	page_nfree = 0;
+	while ((pp = page_free_list) != NULL) {
+		page_free_list = pp->pp_link;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
+}
+
+//
+// Move up to MAG_BATCH pages from the buddy allocator into pm.
+// Returns the number of pages moved.
+//
+static uint32_t
+magazine_refill(struct PageMagazine *pm)
+{
+	struct PageInfo *pp;
+	uint32_t n;
+
+	spin_lock(&page_lock);
+	for (n = 0; n < MAG_BATCH && (pp = buddy_alloc(0)) != NULL; n++) {
+		pp->pp_link = pm->pm_head;
+		pm->pm_head = pp;
+	}
+	spin_unlock(&page_lock);
+	pm->pm_count += n;
+	if (n)
+		pm->pm_nrefill++;
+	return n;
+}
+
+//
+// Move up to MAG_BATCH pages from page_zero_list into pm's zeroed
+// cache.  Returns the number of pages moved.
+//
+static uint32_t
+magazine_refill_zero(struct PageMagazine *pm)
+{
+	struct PageInfo *pp;
+	uint32_t n;
+
+	spin_lock(&page_lock);
+	for (n = 0; n < MAG_BATCH && (pp = page_zero_list) != NULL; n++) {
+		page_zero_list = pp->pp_link;
+		pp->pp_link = pm->pm_zhead;
+		pm->pm_zhead = pp;
+	}
+	page_nzero -= n;
+	spin_unlock(&page_lock);
+	pm->pm_zcount += n;
+	return n;
+}
+
+//
+// Give MAG_BATCH pages from pm back to the buddy allocator.
+//
+static void
+magazine_drain(struct PageMagazine *pm)
+{
+	struct PageInfo *pp;
+	uint32_t n;
+
+	pm->pm_count -= MAG_BATCH;
+	pm->pm_ndrain++;
+
+	spin_lock(&page_lock);
+	for (n = 0; n < MAG_BATCH; n++) {
+		pp = pm->pm_head;
+		pm->pm_head = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
 	}
+	spin_unlock(&page_lock);
 }
 
 //
@@ -347,17 +571,140 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-	if( page_free_list == NULL ) return NULL;
-	struct PageInfo* page = page_free_list;
-	page_free_list = page->pp_link;
+	struct PageMagazine *pm = &thiscpu->cpu_pagemag;
+	struct PageInfo *page;
+	bool zeroed = false;
+
+	if (!page_magazines) {
+		spin_lock(&page_lock);
+		if ((page = page_free_list) != NULL) {
+			page_free_list = page->pp_link;
+			page_nfree--;
+		}
+		spin_unlock(&page_lock);
+		if (!page)
+			return NULL;
+	} else if ((alloc_flags & ALLOC_ZERO) &&
+		   (pm->pm_zcount || magazine_refill_zero(pm))) {
+		// Cheapest: a page an idle CPU already zeroed
+		page = pm->pm_zhead;
+		pm->pm_zhead = page->pp_link;
+		pm->pm_zcount--;
+		pm->pm_nzeroed++;
+		zeroed = true;
+	} else if (pm->pm_count || magazine_refill(pm)) {
+		page = pm->pm_head;
+		pm->pm_head = page->pp_link;
+		pm->pm_count--;
+	} else if (pm->pm_zcount || magazine_refill_zero(pm)) {
+		// Nothing else left; the zeroing was wasted
+		page = pm->pm_zhead;
+		pm->pm_zhead = page->pp_link;
+		pm->pm_zcount--;
+		zeroed = true;
+	} else
+		return NULL;
+	if (page_magazines)
+		pm->pm_nalloc++;
 	page->pp_link = NULL;
 	
-	void* vaddr = page2kva(page);
-	memset(vaddr, 0, PGSIZE);
+	if ((alloc_flags & ALLOC_ZERO) && !zeroed)
+		memset(page2kva(page), 0, PGSIZE);
 	
 	return page;
 }
 
+//
+// Zero one free page and add it to page_zero_list, for idle CPUs to
+// call in a loop.  Returns false, having done nothing, once the
+// pool is full or there are no free pages left to zero.
+//
+bool
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+
+	if (!page_magazines)
+		return false;
+	spin_lock(&page_lock);
+	if (page_nzero >= ZERO_POOL_SIZE || (pp = buddy_alloc(0)) == NULL) {
+		spin_unlock(&page_lock);
+		return false;
+	}
+	spin_unlock(&page_lock);
+
+	memset(page2kva(pp), 0, PGSIZE);
+
+	spin_lock(&page_lock);
+	pp->pp_link = page_zero_list;
+	page_zero_list = pp;
+	page_nzero++;
+	spin_unlock(&page_lock);
+	return true;
+}
+
+//
+// Allocates a physically contiguous, naturally aligned block of
+// 1 << order pages, zeroed if (alloc_flags & ALLOC_ZERO), and returns
+// its first page.  As with page_alloc, no reference counts are
+// incremented.  The block can be given back whole with
+// page_free_order, or page by page with page_free.
+//
+// Returns NULL if there is no free block big enough.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	if (order == 0)
+		return page_alloc(alloc_flags);
+	if (order < 0 || order > PAGE_MAX_ORDER || !page_magazines)
+		return NULL;
+
+	spin_lock(&page_lock);
+	if ((pp = buddy_alloc(order)) == NULL) {
+		// Pages in the pre-zeroed pool may be what stops a block
+		// from merging; give them back and try once more.
+		while ((pp = page_zero_list) != NULL) {
+			page_zero_list = pp->pp_link;
+			pp->pp_link = NULL;
+			buddy_free(pp, 0);
+		}
+		page_nzero = 0;
+		pp = buddy_alloc(order);
+	}
+	spin_unlock(&page_lock);
+
+	if (pp && (alloc_flags & ALLOC_ZERO))
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Free a block of 1 << order pages from page_alloc_order.  Every page
+// of it must have a zero reference count.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	int i;
+
+	if (order == 0) {
+		page_free(pp);
+		return;
+	}
+	for (i = 0; i < (1 << order); i++)
+		if (pp[i].pp_ref != 0 || pp[i].pp_link != NULL)
+			panic("page_free_order: page %d of block in use", i);
+#ifdef DEBUG_PAGE_POISON
+	memset(page2kva(pp), 0xcc, PGSIZE << order);
+#endif
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
@@ -370,12 +717,74 @@ page_free(struct PageInfo *pp)
 	// pp->pp_link is not NULL.
 	if( pp->pp_ref != 0 || pp->pp_link != NULL ) panic("Cannot free");
 	else {
-		pp->pp_link = page_free_list;
-		page_free_list = pp;
+#ifdef DEBUG_PAGE_POISON
 		memset(page2kva(pp), 0xcc, PGSIZE);
+#endif
+		if (!page_magazines) {
+			spin_lock(&page_lock);
+			pp->pp_link = page_free_list;
+			page_free_list = pp;
+			page_nfree++;
+			spin_unlock(&page_lock);
+			return;
+		}
+		struct PageMagazine *pm = &thiscpu->cpu_pagemag;
+		pp->pp_link = pm->pm_head;
+		pm->pm_head = pp;
+		pm->pm_nfree++;
+		if (++pm->pm_count > MAG_SIZE)
+			magazine_drain(pm);
 	}
 }
 
+// Print each CPU's page magazine and TLB shootdown statistics.  Other
+// CPUs' counters are read without synchronization, so they are only
+// approximate.
+void
+page_print_stats(void)
+{
+	struct CpuInfo *c;
+	struct PageMagazine *pm;
+
+	cprintf("free: %u pages, page_zero_list: %u pages\n",
+		page_nfree, page_nzero);
+	cprintf("CPU  cached  zeroed  allocs      prezeroed   frees       refills   drains\n");
+	for (c = cpus; c < cpus + ncpu; c++) {
+		pm = &c->cpu_pagemag;
+		cprintf("%-3d  %-6u  %-6u  %-10u  %-10u  %-10u  %-8u  %u\n",
+			c->cpu_id, pm->pm_count, pm->pm_zcount, pm->pm_nalloc,
+			pm->pm_nzeroed, pm->pm_nfree, pm->pm_nrefill,
+			pm->pm_ndrain);
+	}
+	cprintf("CPU  TLB shootdowns  IPIs\n");
+	for (c = cpus; c < cpus + ncpu; c++)
+		cprintf("%-3d  %-14u  %u\n", c->cpu_id,
+			c->cpu_tlb.tb_nshootdown, c->cpu_tlb.tb_nipi);
+}
+
+// Print the buddy allocator's free blocks by order and, for each
+// order, how much of the free memory is in blocks too small to
+// satisfy a request of that order.
+void
+page_print_buddy(void)
+{
+	size_t nblocks[PAGE_MAX_ORDER + 1], nfree, below = 0;
+	int k;
+
+	spin_lock(&page_lock);
+	memmove(nblocks, buddy_nblocks, sizeof(nblocks));
+	nfree = page_nfree;
+	spin_unlock(&page_lock);
+
+	cprintf("order  size    blocks  unusable\n");
+	for (k = 0; k <= PAGE_MAX_ORDER; k++) {
+		cprintf("%-5d  %4uK  %-6u  %u%%\n", k, 4 << k, nblocks[k],
+			nfree ? below * 100 / nfree : 0);
+		below += nblocks[k] << k;
+	}
+	cprintf("%u pages free\n", nfree);
+}
+
 
 //
 // Decrement the reference count on a page,
@@ -415,6 +824,12 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	struct PageInfo* pg;
 
+	// A 4MB page has no page table; its PDE stands in for the PTE.
+	if (pgdir[PDX(va)] & PTE_PS)
+		return &pgdir[PDX(va)];
+	// A page table shared by fork is copied before it can change.
+	if (create && pgdir_unshare(pgdir, (void *) va) < 0)
+		return NULL;
 	if (pgdir[PDX(va)]) pg = pa2page(PTE_ADDR(pgdir[PDX(va)]));
 	else if (create == false || ( pg = page_alloc(ALLOC_ZERO)) == NULL ) return NULL;
 	else { 
@@ -437,12 +852,24 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // mapped pages.
 //
 // Hint: the TA solution uses pgdir_walk
+//
+// If page_pse is set, every 4MB-aligned stretch of at least 4MB whose
+// page directory entry is still empty is mapped with a single 4MB page.
+// If page_pge is set, the mappings are global.
 static void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
 {
 	// Fill this function in
 	uint32_t i;
+	if (page_pge)
+		perm |= PTE_G;
 	for ( i = 0; i < size; i += PGSIZE ) {
+		if (page_pse && (va + i) % PTSIZE == 0 && (pa + i) % PTSIZE == 0 &&
+		    size - i >= PTSIZE && !(pgdir[PDX(va + i)] & PTE_P)) {
+			pgdir[PDX(va + i)] = (pa + i) | perm | PTE_P | PTE_PS;
+			i += PTSIZE - PGSIZE;
+			continue;
+		}
 		pte_t* pte = pgdir_walk(pgdir, (void*) va + i, true);
 		*pte = (pa + i) | perm | PTE_P;
 		pgdir[PDX(va)] |= PTE_P | perm;
@@ -470,6 +897,7 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if va is inside a 4MB page
 //
 // Hint: The TA solution is implemented using pgdir_walk, page_remove,
 // and page2pa.
@@ -480,6 +908,7 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	// Fill this function in
 	pte_t* pte = pgdir_walk(pgdir, va, PTE_P|perm);
 	if(pte == NULL) return -E_NO_MEM;
+	if (*pte & PTE_PS) return -E_INVAL;
 	pp->pp_ref++;	//needs to be present here as page_remove may free the page in next line
 	if (*pte & PTE_P) { page_remove(pgdir, va); }
 	*pte = page2pa(pp) | perm | PTE_P;
@@ -487,6 +916,254 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	return 0;
 }
 
+//
+// Map the 1 << PAGE_MAX_ORDER page block starting at 'pp', from
+// page_alloc_order, as one 4MB page at 'va', which must be 4MB-aligned.
+// Whatever was mapped in [va, va+PTSIZE) is removed first, along with
+// its page table.  Every page of the block gets a reference, so they
+// can also be mapped elsewhere, and are freed, one at a time.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if 4MB pages are not enabled or va or pp is misaligned
+//
+int
+page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	int i;
+
+	static_assert(PTSIZE == PGSIZE << PAGE_MAX_ORDER);
+	if (!page_pse || (uintptr_t) va % PTSIZE || page2pa(pp) % PTSIZE)
+		return -E_INVAL;
+	for (i = 0; i < NPTENTRIES; i++)
+		pp[i].pp_ref++;
+	if (*pde & PTE_PS)
+		page_remove(pgdir, va);
+	else if (*pde & PTE_P) {
+		for (i = 0; i < NPTENTRIES; i++)
+			page_remove(pgdir, (char *) va + i * PGSIZE);
+		page_decref(pa2page(PTE_ADDR(*pde)));
+	}
+	*pde = page2pa(pp) | perm | PTE_P | PTE_PS;
+	tlb_invalidate(pgdir, va);
+	return 0;
+}
+
+//
+// Copy the user part of the address space 'src' into the empty page
+// directory 'dst', for fork.  Page tables are shared rather than
+// copied: both page directories map each one read-only and PTE_COW,
+// and the first write into its 4MB region copies it (see
+// pgdir_unshare), so fork costs one step per page table instead of one
+// per page.  4MB pages are mapped in both too, read-only and PTE_COW
+// unless they are PTE_SHARE, and split on the first write (see
+// page_cow_fault).  The page table holding the
+// user exception stack, the page ending at 'xstacktop', is copied right
+// away, with writable pages mapped read-only and PTE_COW in both, so
+// that dst can get a fresh exception stack page.  So are page tables
+// holding the NIC's rings mapped by e1000_map, which dst does not get
+// at all.  Called with pmap_lock held.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table or the exception stack couldn't be allocated
+//
+int
+pgdir_copy_cow(pde_t *dst, pde_t *src, uintptr_t xstacktop)
+{
+	struct PageInfo *pp;
+	pte_t *spt, *dpt;
+	uint32_t pdeno, pteno;
+	void *va;
+	int r = 0;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!(src[pdeno] & PTE_P))
+			continue;
+		if (src[pdeno] & PTE_PS) {
+			if ((src[pdeno] & (PTE_W | PTE_COW)) &&
+			    !(src[pdeno] & PTE_SHARE))
+				src[pdeno] = (src[pdeno] & ~PTE_W) | PTE_COW;
+			pp = pa2page(PDE_ADDR_PS(src[pdeno]));
+			if ((r = page_insert_large(dst, pp, PGADDR(pdeno, 0, 0),
+						   src[pdeno] & PTE_SYSCALL)) < 0)
+				goto out;
+			continue;
+		}
+		if (pdeno != PDX(xstacktop - PGSIZE) &&
+		    !e1000_mapped(src, (uintptr_t) PGADDR(pdeno, 0, 0), PTSIZE)) {
+			src[pdeno] = (src[pdeno] & ~PTE_W) | PTE_COW;
+			dst[pdeno] = src[pdeno];
+			pa2page(PTE_ADDR(src[pdeno]))->pp_ref++;
+			continue;
+		}
+
+		if ((r = pgdir_unshare(src, PGADDR(pdeno, 0, 0))) < 0)
+			goto out;
+		if (!(pp = page_alloc(ALLOC_ZERO))) {
+			r = -E_NO_MEM;
+			goto out;
+		}
+		pp->pp_ref++;
+		dst[pdeno] = page2pa(pp) | PTE_P | PTE_W | PTE_U;
+		spt = KADDR(PTE_ADDR(src[pdeno]));
+		dpt = page2kva(pp);
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			va = PGADDR(pdeno, pteno, 0);
+			if (!(spt[pteno] & PTE_P) ||
+			    (uintptr_t) va == xstacktop - PGSIZE ||
+			    e1000_mapped(src, (uintptr_t) va, PGSIZE))
+				continue;
+			if ((spt[pteno] & (PTE_W | PTE_COW)) &&
+			    !(spt[pteno] & PTE_SHARE))
+				spt[pteno] = (spt[pteno] & ~PTE_W) | PTE_COW;
+			dpt[pteno] = PTE_ADDR(spt[pteno]) | (spt[pteno] & PTE_SYSCALL);
+			pa2page(PTE_ADDR(spt[pteno]))->pp_ref++;
+		}
+	}
+
+	va = (void *) (xstacktop - PGSIZE);
+	if (page_lookup(src, va, NULL)) {
+		if (!(pp = page_alloc(ALLOC_ZERO))) {
+			r = -E_NO_MEM;
+			goto out;
+		}
+		if ((r = page_insert(dst, pp, va, PTE_P | PTE_U | PTE_W)) < 0)
+			page_free(pp);
+	}
+out:
+	// src lost write access to everything it now shares.
+	tlb_invalidate_pgdir(src);
+	return r;
+}
+
+//
+// Give pgdir its own copy of the page table for va's 4MB region, if
+// pgdir_copy_cow left it shared, or just take the table back if no
+// other page directory maps it any more.  Writable pages in a copied
+// table become read-only and PTE_COW in both copies, and every page it
+// maps gets a reference for the new copy.  The other page directories
+// keep the table read-only, so their TLBs need no flush.  Called with
+// pmap_lock held.
+//
+// RETURNS:
+//   0 on success, or if the page table was not shared
+//   -E_NO_MEM, if the copy couldn't be allocated
+//
+int
+pgdir_unshare(pde_t *pgdir, void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct PageInfo *pt, *copy;
+	pte_t *spt, *dpt;
+	int i;
+
+	if ((*pde & (PTE_P | PTE_PS | PTE_COW)) != (PTE_P | PTE_COW))
+		return 0;
+	pt = pa2page(PTE_ADDR(*pde));
+	if (pt->pp_ref > 1) {
+		if (!(copy = page_alloc(0)))
+			return -E_NO_MEM;
+		spt = page2kva(pt);
+		dpt = page2kva(copy);
+		for (i = 0; i < NPTENTRIES; i++) {
+			if (!(spt[i] & PTE_P)) {
+				dpt[i] = 0;
+				continue;
+			}
+			if ((spt[i] & PTE_W) && !(spt[i] & PTE_SHARE))
+				spt[i] = (spt[i] & ~PTE_W) | PTE_COW;
+			dpt[i] = spt[i];
+			pa2page(PTE_ADDR(spt[i]))->pp_ref++;
+		}
+		copy->pp_ref++;
+		pt->pp_ref--;
+		pt = copy;
+	}
+	*pde = page2pa(pt) | PTE_P | PTE_W | PTE_U;
+	// Drop the read-only entries cached while the table was shared.
+	tlb_invalidate_pgdir(pgdir);
+	return 0;
+}
+
+//
+// Replace the 4MB page mapped at va's region of 'pgdir' with a page
+// table mapping the same 4KB pages, with the same permissions.  The
+// references the 4MB mapping held on its pages become the new PTEs'.
+// Called with pmap_lock held.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if the page table couldn't be allocated
+//
+static int
+page_split_large(pde_t *pgdir, void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	physaddr_t pa = PDE_ADDR_PS(*pde);
+	struct PageInfo *pt;
+	pte_t *ptes;
+	int i;
+
+	if (!(pt = page_alloc(0)))
+		return -E_NO_MEM;
+	pt->pp_ref++;
+	ptes = page2kva(pt);
+	for (i = 0; i < NPTENTRIES; i++)
+		ptes[i] = (pa + i * PGSIZE) | (*pde & PTE_SYSCALL);
+	*pde = page2pa(pt) | PTE_P | PTE_W | PTE_U;
+	tlb_invalidate(pgdir, ROUNDDOWN(va, PTSIZE));
+	return 0;
+}
+
+//
+// Handle a write fault at 'va' on a copy-on-write page in 'pgdir':
+// map a private, writable copy of the page there, or, if no other
+// mapping of the page is left, just make it writable again.  A shared
+// page table covering va is copied first, and a copy-on-write 4MB page
+// is split into 4KB pages, so that only the one written is copied.
+// Called with pmap_lock held.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if va is not mapped copy-on-write
+//   -E_NO_MEM, if there is no memory for the copy
+//
+int
+page_cow_fault(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *copy;
+	pte_t *pte;
+	bool shared;
+	int perm, r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((pgdir[PDX(va)] & (PTE_P | PTE_PS | PTE_COW)) ==
+	    (PTE_P | PTE_PS | PTE_COW) && (r = page_split_large(pgdir, va)) < 0)
+		return r;
+	shared = (pgdir[PDX(va)] & (PTE_P | PTE_PS | PTE_COW)) ==
+		(PTE_P | PTE_COW);
+	if (shared && (r = pgdir_unshare(pgdir, va)) < 0)
+		return r;
+	// If only the page table was shared, the write may go through now.
+	if (!(pp = page_lookup(pgdir, va, &pte)) || (*pte & PTE_PS) ||
+	    !(*pte & PTE_COW))
+		return shared ? 0 : -E_INVAL;
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+	if (!(copy = page_alloc(0)))
+		return -E_NO_MEM;
+	memmove(page2kva(copy), page2kva(pp), PGSIZE);
+	if ((r = page_insert(pgdir, copy, va, perm)) < 0)
+		page_free(copy);
+	return r;
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -507,6 +1184,8 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 	if(!( *pte & PTE_P ) ) return NULL;
 	if ( NULL != pte_store ) *pte_store = pte;
 	
+	if (*pte & PTE_PS)
+		return pa2page(PDE_ADDR_PS(*pte) + PTX(va) * PGSIZE);
 	return pa2page(PTE_ADDR(*pte));
 }
 
@@ -525,28 +1204,203 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
+// If va is inside a 4MB page, the whole 4MB page is unmapped.
+// Futex waiters in an unmapped 4KB page are woken (see futex_wake_page).
+//
 void
 page_remove(pde_t *pgdir, void *va)
 {
 	// Fill this function in
 	pte_t *pte_store;
+	int i;
+	// A page table shared by fork is copied first.  Without memory for
+	// that, the page stays mapped.
+	if (pgdir_unshare(pgdir, va) < 0)
+		return;
 	struct PageInfo* pg = page_lookup(pgdir, va, &pte_store);
 	if( pg == NULL ) return;
-	page_decref(pg);
-	tlb_invalidate(pgdir, va);
+	if (*pte_store & PTE_PS) {
+		pg = pa2page(PDE_ADDR_PS(*pte_store));
+		*pte_store = 0;
+		tlb_invalidate(pgdir, ROUNDDOWN(va, PTSIZE));
+		for (i = 0; i < NPTENTRIES; i++)
+			page_decref_unmapped(pg + i);
+		return;
+	}
 	*pte_store = 0;
+	tlb_invalidate(pgdir, va);
+	page_decref_unmapped(pg);
+	futex_wake_page(page2pa(pg));
+}
+
+//
+// Drop the reference a mapping just taken out of a page table held on
+// its page.  Until tlb_shootdown has run, other CPUs may still reach
+// the page through their TLBs, so if it becomes free it waits for that.
+//
+static void
+page_decref_unmapped(struct PageInfo *pp)
+{
+	struct TlbBatch *tb = &thiscpu->cpu_tlb;
+
+	if (--pp->pp_ref > 0)
+		return;
+	if (!tb->tb_targets) {
+		page_free(pp);
+		return;
+	}
+	pp->pp_link = tb->tb_free;
+	tb->tb_free = pp;
+}
+
+//
+// Load pgdir into %cr3, unless it is already there, and publish it in
+// cpu_pgdir for tlb_invalidate.
+//
+void
+pgdir_switch(pde_t *pgdir)
+{
+	if (thiscpu->cpu_pgdir == pgdir)
+		return;
+	// Publish first: a CPU that edits pgdir after we have loaded it
+	// must see that it has to tell us.
+	xchg((volatile uint32_t *) &thiscpu->cpu_pgdir, (uint32_t) pgdir);
+	lcr3(PADDR(pgdir));
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
 //
+// Other CPUs that have pgdir loaded are not interrupted right away:
+// the entry is queued in this CPU's TlbBatch, and tlb_shootdown sends
+// the whole batch with one IPI per CPU on the way back to user mode.
+// Call this after changing the PTE.
+//
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
+	struct TlbBatch *tb = &thiscpu->cpu_tlb;
+	uint32_t targets;
+
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	if (thiscpu->cpu_pgdir == pgdir)
 		invlpg(va);
+
+	if (!(targets = tlb_targets(pgdir)))
+		return;
+
+	tb->tb_targets |= targets;
+	if (tb->tb_n < TLB_BATCH) {
+		tb->tb_ent[tb->tb_n].te_pgdir = pgdir;
+		tb->tb_ent[tb->tb_n].te_va = (uintptr_t) va;
+		tb->tb_n++;
+	} else
+		tb->tb_all = true;
+}
+
+//
+// Like tlb_invalidate, but for all of pgdir's mappings at once, after a
+// change to the page directory itself.
+//
+void
+tlb_invalidate_pgdir(pde_t *pgdir)
+{
+	struct TlbBatch *tb = &thiscpu->cpu_tlb;
+	uint32_t targets;
+
+	if (thiscpu->cpu_pgdir == pgdir)
+		lcr3(PADDR(pgdir));
+	if ((targets = tlb_targets(pgdir))) {
+		tb->tb_targets |= targets;
+		tb->tb_all = true;
+	}
+}
+
+//
+// Return the mask of other CPUs that have pgdir loaded.
+//
+static uint32_t
+tlb_targets(pde_t *pgdir)
+{
+	struct CpuInfo *c;
+	uint32_t targets = 0;
+
+	// Order the page table change before the reads of cpu_pgdir; see
+	// pgdir_switch.
+	asm volatile("mfence" ::: "memory");
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != thiscpu && c->cpu_pgdir == pgdir)
+			targets |= 1 << (c - cpus);
+	return targets;
+}
+
+//
+// Send the invalidations queued by tlb_invalidate to the CPUs that
+// need them, wait until they have all carried them out, and free the
+// pages that were waiting on that.  Must be called with no spinlocks
+// held, since the other CPUs may need those locks before they can
+// take the interrupt.
+//
+void
+tlb_shootdown(void)
+{
+	struct TlbBatch *tb = &thiscpu->cpu_tlb;
+	struct PageInfo *pp;
+	int i;
+
+	if (!tb->tb_targets)
+		return;
+	xchg(&tb->tb_pending, tb->tb_targets);
+	for (i = 0; i < ncpu; i++)
+		if (tb->tb_targets & (1 << i)) {
+			lapic_ipi_cpu(cpus[i].cpu_id, IRQ_OFFSET + IRQ_TLB);
+			tb->tb_nipi++;
+		}
+	tb->tb_nshootdown++;
+	// Interrupts are off, so serve other CPUs' shootdowns while we
+	// wait in case they are waiting on us.
+	while (tb->tb_pending) {
+		tlb_shootdown_ack();
+		asm volatile("pause");
+	}
+
+	tb->tb_targets = 0;
+	tb->tb_n = 0;
+	tb->tb_all = false;
+	while ((pp = tb->tb_free) != NULL) {
+		tb->tb_free = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+}
+
+//
+// Carry out the invalidations that other CPUs have asked of this one.
+// Called from the IRQ_TLB handler, and while waiting in tlb_shootdown.
+//
+void
+tlb_shootdown_ack(void)
+{
+	uint32_t me = 1 << cpunum(), pending;
+	struct CpuInfo *c;
+	struct TlbBatch *tb;
+	uint32_t i;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		tb = &c->cpu_tlb;
+		if (c == thiscpu || !(tb->tb_pending & me))
+			continue;
+		if (tb->tb_all)
+			lcr3(rcr3());
+		else
+			for (i = 0; i < tb->tb_n; i++)
+				if (tb->tb_ent[i].te_pgdir == thiscpu->cpu_pgdir)
+					invlpg((void *) tb->tb_ent[i].te_va);
+		do
+			pending = tb->tb_pending;
+		while (cmpxchg(&tb->tb_pending, pending, pending & ~me) != pending);
+	}
 }
 
 //
@@ -601,7 +1455,8 @@ static uintptr_t user_mem_check_addr;
 //
 // A user program can access a virtual address if (1) the address is below
 // ULIM, and (2) the page table gives it permission.  These are exactly
-// the tests you should implement here.
+// the tests you should implement here.  The page directory entry counts
+// too, since a page table shared by fork is mapped read-only.
 //
 // If there is an error, set the 'user_mem_check_addr' variable to the first
 // erroneous virtual address.
@@ -620,7 +1475,7 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 
 	for(; bottom < top; bottom += PGSIZE) {
 
-		if(bottom >= ULIM || (pte = pgdir_walk(env->env_pgdir, (void *)bottom, 0)) == NULL ||  (*pte & perm) != perm) {
+		if(bottom >= ULIM || (pte = pgdir_walk(env->env_pgdir, (void *)bottom, 0)) == NULL ||  (*pte & env->env_pgdir[PDX(bottom)] & perm) != perm) {
 			// If the first page check failed, the faulting address  should be va, not ROUNDOWN(va, PGSIZE)
 			if (bottom < (uint32_t)va) user_mem_check_addr = (uint32_t)va;
 			else user_mem_check_addr = bottom;
@@ -648,6 +1503,64 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 	}
 }
 
+//
+// Copy len bytes from src to dst, where one side is user memory of the
+// current environment.  A page fault on the way, say because another
+// thread of the environment unmapped the page after it was checked,
+// makes page_fault_handler resume at the end of the copy with %eax set
+// to -E_FAULT rather than panic.
+//
+static int
+user_copy(void *dst, const void *src, size_t len)
+{
+	uintptr_t *fixup = &thiscpu->cpu_ufixup;
+	int r;
+
+	asm volatile("movl $1f, %4\n"
+		     "\txorl %%eax, %%eax\n"
+		     "\trep movsb\n"
+		     "1:\tmovl $0, %4"
+		     : "=&a" (r), "+D" (dst), "+S" (src), "+c" (len),
+		       "=m" (*fixup)
+		     : : "memory", "cc");
+	return r;
+}
+
+// Returns true if [va, va+len) is entirely below UTOP.
+static bool
+user_range_ok(const void *va, size_t len)
+{
+	return (uintptr_t) va <= UTOP && len <= UTOP - (uintptr_t) va;
+}
+
+//
+// Copy len bytes from the current environment's memory at va to dst.
+// Returns 0 on success, or -E_FAULT if the range is not below UTOP or
+// some page of it is not mapped readable to the environment.
+//
+int
+user_copy_in(void *dst, const void *va, size_t len)
+{
+	if (!user_range_ok(va, len) ||
+	    user_mem_check(curenv, va, len, PTE_U) < 0)
+		return -E_FAULT;
+	return user_copy(dst, va, len);
+}
+
+//
+// Copy len bytes from src to the current environment's memory at va.
+// Returns 0 on success, or -E_FAULT if the range is not below UTOP or
+// some page of it is not mapped writable to the environment.
+//
+int
+user_copy_out(void *va, const void *src, size_t len)
+{
+	if (!user_range_ok(va, len) ||
+	    user_mem_check(curenv, va, len, PTE_U | PTE_W) < 0)
+		return -E_FAULT;
+	return user_copy(va, src, len);
+}
+
 
 // --------------------------------------------------------------
 // Checking functions.
@@ -869,6 +1782,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PDE_ADDR_PS(*pgdir) + PTX(va) * PGSIZE;
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
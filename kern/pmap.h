@@ -8,6 +8,7 @@
 
 #include <inc/memlayout.h>
 #include <inc/assert.h>
+#include <kern/spinlock.h>
 struct Env;
 
 extern char bootstacktop[], bootstack[];
@@ -16,6 +17,8 @@ extern struct PageInfo *pages;
 extern size_t npages;
 
 extern pde_t *kern_pgdir;
+extern bool page_pse, page_pge;
+extern struct spinlock pmap_lock;
 
 
 /* This macro takes a kernel virtual address -- an address that points above
@@ -51,22 +54,43 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// Largest block page_alloc_order hands out: 1 << PAGE_MAX_ORDER pages
+#define PAGE_MAX_ORDER	10
+
+// Uncomment this to fill freed pages with 0xcc, to catch use after free
+// #define DEBUG_PAGE_POISON
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
+void	page_print_stats(void);
+void	page_print_buddy(void);
+bool	page_zero_idle(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	page_insert_large(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	pgdir_copy_cow(pde_t *dst, pde_t *src, uintptr_t xstacktop);
+int	pgdir_unshare(pde_t *pgdir, void *va);
+int	page_cow_fault(pde_t *pgdir, void *va);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
+void	pgdir_switch(pde_t *pgdir);
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_invalidate_pgdir(pde_t *pgdir);
+void	tlb_shootdown(void);
+void	tlb_shootdown_ack(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int	user_copy_in(void *dst, const void *va, size_t len);
+int	user_copy_out(void *va, const void *src, size_t len);
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
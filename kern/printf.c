@@ -5,6 +5,8 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+
 
 static void
 putch(int ch, int *cnt)
@@ -16,9 +18,16 @@ putch(int ch, int *cnt)
 int
 vcprintf(const char *fmt, va_list ap)
 {
+	extern const char *panicstr;
 	int cnt = 0;
 
+	// A panicking CPU may already hold the lock, and the other CPUs
+	// are halting; print unlocked rather than deadlock.
+	if (!panicstr)
+		spin_lock(&cons_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	if (!panicstr)
+		spin_unlock(&cons_lock);
 	return cnt;
 }
 
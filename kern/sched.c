@@ -4,47 +4,341 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/time.h>
 
-void sched_halt(void);
+void sched_halt(void) __attribute__((noreturn));
 
-// Choose a user environment to run and run it.
+// Most pages sched_halt zeroes each time a CPU goes idle
+#define IDLE_ZERO_PAGES	64
+
+// Set once some CPU has dropped into the monitor from sched_halt
+static uint32_t in_monitor;
+
+// Set up every CPU's run queue.
 void
-sched_yield(void)
+sched_init(void)
 {
-	struct Env *idle;
-
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-	int i;
-	uint32_t envid = curenv ? ENVX(curenv->env_id) : 0;
-	uint32_t first_eid = (++envid) % NENV;
-	uint32_t next_envid;
+	struct CpuInfo *c;
 
-	// case: env status is RUNNABLE
-	for (i = 0; i < NENV; i++) {
-		next_envid = (first_eid + i) % NENV;
-		if (envs[next_envid].env_status == ENV_RUNNABLE) {
-			env_run(&envs[next_envid]);
+	for (c = cpus; c < cpus + NCPU; c++)
+		spin_initlock(&c->cpu_runq.rq_lock, LOCK_RANK_RUNQ);
+}
+
+// Fair class weights by nice value, from ENV_PRIO_NICE_MIN up.  Each
+// step is about a 1.25x change in CPU share; nice 0 weighs NICE_0_WEIGHT.
+#define NICE_0_WEIGHT	1024
+static const uint32_t nice_weight[] = {
+	9548, 7620, 6100, 4904, 3906, 3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423, 335, 272, 215, 172, 137, 110,
+};
+
+// How far behind the queue a woken fair environment may start, in TSC
+// cycles, so that sleepers get a head start but cannot hog the CPU.
+#define WAKEUP_CREDIT	(1 << 22)
+
+// Add the time curenv has run since cpu_run_start to its run time and,
+// if it is in the fair class, to its vruntime scaled by its weight.
+void
+sched_charge(void)
+{
+	struct Env *e = curenv;
+	uint64_t now = read_tsc();
+	uint64_t delta = now - thiscpu->cpu_run_start;
+
+	thiscpu->cpu_run_start = now;
+	if (!e)
+		return;
+	e->env_runtime += delta;
+	if (!ENV_PRIO_IS_RT(e->env_priority))
+		e->env_vruntime += delta * NICE_0_WEIGHT /
+			nice_weight[e->env_priority - ENV_PRIO_NICE_MIN];
+}
+
+// The fair heap is ordered on env_vruntime, smallest at rq_fair[0].
+static void
+fair_push(struct Runqueue *rq, struct Env *e)
+{
+	uint32_t i = rq->rq_nfair++, parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (rq->rq_fair[parent]->env_vruntime <= e->env_vruntime)
+			break;
+		rq->rq_fair[i] = rq->rq_fair[parent];
+		i = parent;
+	}
+	rq->rq_fair[i] = e;
+}
+
+static struct Env *
+fair_pop(struct Runqueue *rq)
+{
+	struct Env *top = rq->rq_fair[0], *last;
+	uint32_t i = 0, child, n;
+
+	n = --rq->rq_nfair;
+	last = rq->rq_fair[n];
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && rq->rq_fair[child + 1]->env_vruntime <
+		    rq->rq_fair[child]->env_vruntime)
+			child++;
+		if (last->env_vruntime <= rq->rq_fair[child]->env_vruntime)
 			break;
+		rq->rq_fair[i] = rq->rq_fair[child];
+		i = child;
+	}
+	rq->rq_fair[i] = last;
+	if (top->env_vruntime > rq->rq_min_vruntime)
+		rq->rq_min_vruntime = top->env_vruntime;
+	return top;
+}
+
+// Idle CPUs have no timer ticking to make them look for work, so wake
+// one of them up to come and steal what was just queued here.
+static void
+sched_kick(void)
+{
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c != thiscpu && c->cpu_status == CPU_HALTED) {
+			lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+			return;
+		}
+	}
+}
+
+// Queue e on this CPU, unless it is already queued on some CPU.
+// Callers set e->env_status to ENV_RUNNABLE first.
+//
+// Entries are removed lazily: an environment that stops being
+// ENV_RUNNABLE while queued (it was destroyed, blocked, or stolen)
+// stays on the queue and is simply skipped when it reaches the head.
+void
+sched_enqueue(struct Env *e)
+{
+	struct Runqueue *rq = &thiscpu->cpu_runq;
+	int level;
+
+	if (cmpxchg(&e->env_rq_queued, ENV_RQ_NONE, ENV_RQ_QUEUED)
+	    != ENV_RQ_NONE)
+		return;
+	spin_lock(&rq->rq_lock);
+	if (ENV_PRIO_IS_RT(e->env_priority)) {
+		level = e->env_priority - ENV_PRIO_RT_MIN;
+		e->env_rq_link = NULL;
+		if (rq->rq_rt_tail[level])
+			rq->rq_rt_tail[level]->env_rq_link = e;
+		else
+			rq->rq_rt_head[level] = e;
+		rq->rq_rt_tail[level] = e;
+	} else {
+		// An env coming back from a long sleep, or from another
+		// CPU, would otherwise lag far behind this queue.
+		if (e->env_vruntime + WAKEUP_CREDIT < rq->rq_min_vruntime)
+			e->env_vruntime = rq->rq_min_vruntime - WAKEUP_CREDIT;
+		fair_push(rq, e);
+	}
+	rq->rq_len++;
+	spin_unlock(&rq->rq_lock);
+	sched_kick();
+}
+
+// Make e runnable if it is blocked.  Safe against e being blocked,
+// woken, or destroyed concurrently on other CPUs.
+void
+sched_wakeup(struct Env *e)
+{
+	if (cmpxchg(&e->env_status, ENV_NOT_RUNNABLE, ENV_RUNNABLE)
+	    == ENV_NOT_RUNNABLE)
+		sched_enqueue(e);
+}
+
+// Block curenv and run something else.  The caller holds lk, which
+// protects the condition curenv is waiting on; lk is released only
+// after curenv is marked ENV_NOT_RUNNABLE, so a waker that takes lk
+// and then calls sched_wakeup cannot miss it.  Does not return.
+void
+sched_block(struct spinlock *lk)
+{
+	sched_block_to(lk, NULL);
+}
+
+// Like sched_block, but if next is non-null, switch straight to it
+// instead of going through the run queue.  next must be blocked and
+// already handed whatever it was waiting for, so that nobody else
+// will wake it; if it was destroyed meanwhile, fall back to
+// sched_yield.  Does not return.
+void
+sched_block_to(struct spinlock *lk, struct Env *next)
+{
+	struct Env *e = curenv;
+
+	// Claim next while lk still keeps it from being freed.
+	if (next && cmpxchg(&next->env_status, ENV_NOT_RUNNABLE, ENV_RUNNING)
+	    != ENV_NOT_RUNNABLE)
+		next = NULL;
+
+	// Let go of e before it becomes visible as blocked: once it is,
+	// another CPU may wake it and start running it.
+	sched_charge();
+	curenv = NULL;
+	pgdir_switch(kern_pgdir);
+
+	if (cmpxchg(&e->env_status, ENV_RUNNING, ENV_NOT_RUNNABLE)
+	    == ENV_RUNNING) {
+		spin_unlock(lk);
+	} else {
+		// Another CPU destroyed e while it was running here.
+		spin_unlock(lk);
+		env_free(e);
+	}
+	if (next)
+		env_run(next);
+	sched_yield();
+}
+
+// Give the rest of curenv's time slice to e, which must be blocked and
+// already handed whatever it was waiting for, by running e right now.
+// The caller holds lk, which keeps e from being freed until we have
+// claimed it, and sets up curenv's system call return value first;
+// curenv stays runnable and goes to the back of this CPU's run queue.
+// Releases lk.  Returns only if e was destroyed in the meantime.
+void
+sched_handoff(struct spinlock *lk, struct Env *e)
+{
+	if (cmpxchg(&e->env_status, ENV_NOT_RUNNABLE, ENV_RUNNING)
+	    != ENV_NOT_RUNNABLE) {
+		spin_unlock(lk);
+		return;
+	}
+	spin_unlock(lk);
+	curenv->env_ipc_donations++;
+	e->env_ipc_donated++;
+	env_run(e);
+}
+
+// Take the next entry off rq: the head of the highest non-empty
+// real-time queue, else the fair env with the least vruntime.
+// Called with rq_lock held, and rq not empty.
+static struct Env *
+runq_take(struct Runqueue *rq)
+{
+	struct Env *e;
+	int level;
+
+	rq->rq_len--;
+	for (level = NRTPRIO - 1; level >= 0; level--) {
+		if ((e = rq->rq_rt_head[level]) != NULL) {
+			if (!(rq->rq_rt_head[level] = e->env_rq_link))
+				rq->rq_rt_tail[level] = NULL;
+			e->env_rq_link = NULL;
+			return e;
 		}
-	}	
+	}
+	return fair_pop(rq);
+}
+
+// Remove and return the best ENV_RUNNABLE environment on rq,
+// discarding stale entries along the way, and mark it ENV_RUNNING
+// so that no other CPU can claim it.  Returns NULL if there is none.
+// Stale entries of freed environments were keeping their slots from
+// reuse; they go back on the free list once rq_lock is released.
+static struct Env *
+runq_pop(struct Runqueue *rq)
+{
+	struct Env *e = NULL, *freed = NULL, *next;
+
+	spin_lock(&rq->rq_lock);
+	while (rq->rq_len > 0) {
+		e = runq_take(rq);
+		// Clear the flag before claiming e, so that a wakeup
+		// racing with us either sees e as queued or requeues it.
+		if (xchg(&e->env_rq_queued, ENV_RQ_NONE) == ENV_RQ_FREED) {
+			e->env_link = freed;
+			freed = e;
+		} else if (cmpxchg(&e->env_status, ENV_RUNNABLE, ENV_RUNNING)
+			   == ENV_RUNNABLE)
+			break;
+		e = NULL;
+	}
+	spin_unlock(&rq->rq_lock);
+	// env_lock ranks above the run queue locks.
+	while (freed) {
+		next = freed->env_link;
+		env_recycle(freed);
+		freed = next;
+	}
+	return e;
+}
 
-	// case: env status is RUNNING	
-	if( curenv && curenv->env_status == ENV_RUNNING ) { env_run(curenv); return; }
+// Whether something queued on rq should take the CPU from cur, which
+// has just been charged: a real-time env of higher priority, or of
+// equal priority (round-robin), or a fair env that is further behind.
+static bool
+runq_preempts(struct Runqueue *rq, struct Env *cur)
+{
+	int level, curlevel = -1;
+	bool r = false;
+
+	if (ENV_PRIO_IS_RT(cur->env_priority))
+		curlevel = cur->env_priority - ENV_PRIO_RT_MIN;
+	spin_lock(&rq->rq_lock);
+	for (level = NRTPRIO - 1; level >= 0 && level >= curlevel; level--)
+		if (rq->rq_rt_head[level])
+			r = true;
+	if (!r && curlevel < 0 && rq->rq_nfair > 0)
+		r = rq->rq_fair[0]->env_vruntime < cur->env_vruntime;
+	spin_unlock(&rq->rq_lock);
+	return r;
+}
+
+// Called on every timer tick.  Charge curenv for its time and switch
+// away if something on this CPU's run queue should preempt it;
+// otherwise return, and the caller resumes curenv.
+void
+sched_tick(void)
+{
+	sched_charge();
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+	    !runq_preempts(&thiscpu->cpu_runq, curenv))
+		return;
+	sched_yield();
+}
+
+// Take a runnable environment from the CPU with the longest run queue.
+static struct Env *
+runq_steal(void)
+{
+	struct CpuInfo *c, *victim = NULL;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || c->cpu_runq.rq_len == 0)
+			continue;
+		if (!victim || c->cpu_runq.rq_len > victim->cpu_runq.rq_len)
+			victim = c;
+	}
+	return victim ? runq_pop(&victim->cpu_runq) : NULL;
+}
+
+// Choose a user environment to run and run it.
+void
+sched_yield(void)
+{
+	struct Env *e;
+
+	// Take the best entry on this CPU's run queue: the oldest of the
+	// highest real-time priority, else the fair environment with the
+	// least vruntime (see runq_take).  env_run queues a preempted
+	// curenv again, so nothing needs to scan all of 'envs'.
+	if ((e = runq_pop(&thiscpu->cpu_runq)) != NULL)
+		env_run(e);
+
+	// If nothing else is queued here, but the environment previously
+	// running on this CPU is still ENV_RUNNING, keep running it.
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		env_run(curenv);
 
 	// sched_halt never returns
 	sched_halt();
@@ -56,33 +350,58 @@ sched_yield(void)
 void
 sched_halt(void)
 {
+	struct Env *e;
 	int i;
 
+	// Before going idle, take work from a busier CPU.
+	if ((e = runq_steal()) != NULL)
+		env_run(e);
+
+	// Mark that no environment is running on this CPU.  The only
+	// way curenv can still be set here is that another CPU
+	// destroyed it while it ran, leaving it for us to free.
+	if ((e = curenv) != NULL) {
+		curenv = NULL;
+		pgdir_switch(kern_pgdir);
+		if (e->env_status == ENV_DYING)
+			env_free(e);
+	}
+	tlb_shootdown();
+
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
+	// Only the first CPU to notice does so; the rest halt.
 	for (i = 0; i < NENV; i++) {
 		if ((envs[i].env_status == ENV_RUNNABLE ||
 		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+		     envs[i].env_status == ENV_DYING ||
+		     envs[i].env_timeout))
 			break;
 	}
-	if (i == NENV) {
+	if (i == NENV && xchg(&in_monitor, 1) == 0) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on this CPU
-	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	// Use the idle time to refill the pre-zeroed page pool, a few
+	// pages at a time, going back to work as soon as there is some.
+	for (i = 0; i < IDLE_ZERO_PAGES && page_zero_idle(); i++)
+		if ((e = runq_steal()) != NULL)
+			env_run(e);
 
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// Mark that this CPU is in the HALT state.  From now on, a CPU
+	// that queues work will kick us; look once more in case some
+	// CPU did so just before it could see that we are halted.
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	if ((e = runq_steal()) != NULL) {
+		xchg(&thiscpu->cpu_status, CPU_STARTED);
+		env_run(e);
+	}
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// Go tickless: only wake up for a sleeper's deadline or a kick.
+	thiscpu->cpu_tickless = true;
+	time_arm(false);
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -95,5 +414,6 @@ sched_halt(void)
 		"hlt\n"
 		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("hlt loop exited");  /* mostly to placate the compiler */
 }
 
@@ -6,7 +6,23 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+struct spinlock;
+
+// Longest a CPU runs one environment before the timer preempts it.
+#define SCHED_QUANTUM_USEC	10000
+
+void sched_init(void);
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_enqueue(struct Env *e);
+void sched_charge(void);
+void sched_tick(void);
+void sched_wakeup(struct Env *e);
+void sched_block(struct spinlock *lk) __attribute__((noreturn));
+void sched_handoff(struct spinlock *lk, struct Env *e);
+void sched_block_to(struct spinlock *lk, struct Env *next)
+	__attribute__((noreturn));
 
 #endif	// !JOS_KERN_SCHED_H
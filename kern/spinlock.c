@@ -9,12 +9,12 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
+#ifdef SPINLOCK_STATS
+// Every lock that has been acquired at least once, for spin_print_stats
+#define NLOCKSTATS	64
+static struct spinlock *lockstats[NLOCKSTATS];
+static uint32_t nlockstats;
 #endif
-};
 
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
@@ -39,16 +39,60 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->next != lock->owner && lock->cpu == thiscpu;
+}
+
+// Check that acquiring lk respects the lock order, then record it as
+// held by this CPU.  Called before spinning, so an out-of-order
+// acquisition is reported even when it does not happen to deadlock.
+static void
+push_held(struct spinlock *lk)
+{
+	struct CpuInfo *c = thiscpu;
+	int i;
+
+	for (i = 0; i < c->cpu_nlocks; i++)
+		if (lk->rank != LOCK_RANK_NONE
+		    && c->cpu_locks[i]->rank >= lk->rank)
+			panic("CPU %d cannot acquire %s: lock order violation "
+			      "(holding %s)", cpunum(), lk->name,
+			      c->cpu_locks[i]->name);
+	if (c->cpu_nlocks == NLOCKHELD)
+		panic("CPU %d cannot acquire %s: too many locks held",
+		      cpunum(), lk->name);
+	c->cpu_locks[c->cpu_nlocks++] = lk;
+}
+
+// Forget that this CPU holds lk.  Locks need not be released in the
+// reverse order they were taken.
+static void
+pop_held(struct spinlock *lk)
+{
+	struct CpuInfo *c = thiscpu;
+	int i;
+
+	for (i = 0; i < c->cpu_nlocks; i++)
+		if (c->cpu_locks[i] == lk) {
+			c->cpu_locks[i] = c->cpu_locks[--c->cpu_nlocks];
+			return;
+		}
 }
 #endif
 
 void
-__spin_initlock(struct spinlock *lk, char *name)
+__spin_initlock(struct spinlock *lk, char *name, int rank)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	lk->next = 0;
+	lk->owner = 0;
 	lk->name = name;
+#ifdef SPINLOCK_STATS
+	lk->nacquire = 0;
+	lk->ncontended = 0;
+	lk->spin_cycles = 0;
+	lk->max_hold = 0;
+#endif
+#ifdef DEBUG_SPINLOCK
+	lk->rank = rank;
 	lk->cpu = 0;
 #endif
 }
@@ -60,16 +104,45 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	uint32_t ticket;
+#ifdef SPINLOCK_STATS
+	uint64_t start = 0;
+	uint32_t i;
+#endif
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+	push_held(lk);
 #endif
 
-	// The xchg is atomic.
-	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	// The xadd is atomic and serializing, so no two CPUs get the
+	// same ticket.  Waiting only reads 'owner', which stays in this
+	// CPU's cache until the holder releases the lock.
+	ticket = xadd(&lk->next, 1);
+	if (lk->owner != ticket) {
+#ifdef SPINLOCK_STATS
+		start = read_tsc();
+#endif
+		while (lk->owner != ticket)
+			asm volatile ("pause");
+	}
+	// Keep the critical section from being hoisted above the wait.
+	asm volatile ("" : : : "memory");
+
+#ifdef SPINLOCK_STATS
+	lk->hold_start = read_tsc();
+	lk->nacquire++;
+	if (start) {
+		lk->ncontended++;
+		lk->spin_cycles += lk->hold_start - start;
+	}
+	if (!lk->registered) {
+		lk->registered = 1;
+		if ((i = xadd(&nlockstats, 1)) < NLOCKSTATS)
+			lockstats[i] = lk;
+	}
+#endif
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -103,18 +176,66 @@ spin_unlock(struct spinlock *lk)
 		panic("spin_unlock");
 	}
 
+	pop_held(lk);
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
 #endif
 
-	// The xchg serializes, so that reads before release are 
-	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-	// 7.2) says reads can be carried out speculatively and in
-	// any order, which implies we need to serialize here.
-	// But the 2007 Intel 64 Architecture Memory Ordering White
-	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
+#ifdef SPINLOCK_STATS
+	uint64_t held = read_tsc() - lk->hold_start;
+	if (held > lk->max_hold)
+		lk->max_hold = held;
+#endif
+
+	// Hand the lock to the next ticket.  Only the holder writes
+	// 'owner', so this need not be atomic, but the xchg serializes,
+	// so that reads before release are not reordered after it.
 	// The xchg being asm volatile ensures gcc emits it after
 	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+	xchg(&lk->owner, lk->owner + 1);
+}
+
+// Panic if this CPU still holds any spinlock.  Called on the way back
+// to user mode, where holding a lock can only be a leak.
+void
+spin_assert_none_held(void)
+{
+#ifdef DEBUG_SPINLOCK
+	if (thiscpu->cpu_nlocks > 0)
+		panic("CPU %d returning to user mode holding %s",
+		      cpunum(), thiscpu->cpu_locks[0]->name);
+#endif
+}
+
+// Print statistics for the n locks that were contended most often.
+void
+spin_print_stats(int n)
+{
+#ifdef SPINLOCK_STATS
+	struct spinlock *sorted[NLOCKSTATS], *lk;
+	uint32_t i, j, count;
+
+	count = MIN(nlockstats, NLOCKSTATS);
+	memmove(sorted, lockstats, count * sizeof(sorted[0]));
+
+	// Insertion sort by contended acquisitions, most first
+	for (i = 1; i < count; i++) {
+		lk = sorted[i];
+		for (j = i; j > 0 && sorted[j-1]->ncontended < lk->ncontended; j--)
+			sorted[j] = sorted[j-1];
+		sorted[j] = lk;
+	}
+
+	cprintf("%-16s %10s %10s %12s %12s\n", "lock", "acquired",
+		"contended", "avg spin", "max hold");
+	for (i = 0; i < count && i < n; i++) {
+		lk = sorted[i];
+		cprintf("%-16s %10u %10u %12llu %12llu\n", lk->name,
+			lk->nacquire, lk->ncontended,
+			lk->ncontended ? lk->spin_cycles / lk->ncontended : 0,
+			lk->max_hold);
+	}
+#else
+	cprintf("Lock statistics are disabled (SPINLOCK_STATS)\n");
+#endif
 }
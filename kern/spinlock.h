@@ -6,43 +6,72 @@
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
+// Comment this to disable per-lock contention statistics
+#define SPINLOCK_STATS
+
+// Lock ranks, lowest first.  With DEBUG_SPINLOCK, a CPU that tries to
+// acquire a lock whose rank is not strictly greater than the rank of
+// every lock it already holds panics, so any deadlock-prone ordering
+// shows up the first time it is exercised.  Locks of equal rank (for
+// example two CPUs' run queues) must never be held together.
+enum {
+	LOCK_RANK_NONE = 0,	// Not checked
+	LOCK_RANK_ENV,		// env_lock: env table and free list
+	LOCK_RANK_IPC,		// ipc_lock: env_ipc_* fields of every Env
+	LOCK_RANK_PMAP,		// pmap_lock: user page tables and pp_ref
+	LOCK_RANK_PAGE,		// page_lock: page_free_list
+	LOCK_RANK_TIMER,	// timer_lock: sleeping environments, futexes
+	LOCK_RANK_RUNQ,		// A CPU's run queue
+	LOCK_RANK_E1000,	// e1000 descriptor rings
+	LOCK_RANK_CONSIN,	// Console input buffer
+	LOCK_RANK_CONS,		// Console output
+};
+
+// Maximum number of locks a CPU can hold at once
+#define NLOCKHELD	8
+
 // Mutual exclusion lock.
+//
+// This is a ticket lock: each acquirer takes the next ticket and
+// spins until 'owner' reaches it, so CPUs get the lock in the order
+// they asked for it and waiters only read the shared line.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile uint32_t next;  // Next ticket to hand out
+	volatile uint32_t owner; // Ticket of the current holder
+	char *name;              // Name of lock.
+
+#ifdef SPINLOCK_STATS
+	// Updated only by the holder, so no atomics are needed.
+	uint32_t registered;     // Listed in the lock statistics table?
+	uint32_t nacquire;       // Number of acquisitions
+	uint32_t ncontended;     // Acquisitions that had to wait
+	uint64_t spin_cycles;    // Total TSC cycles spent waiting
+	uint64_t max_hold;       // Longest hold, in TSC cycles
+	uint64_t hold_start;     // TSC when the current holder got it
+#endif
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
+	int rank;              // Position in the lock order (LOCK_RANK_*)
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
 };
 
-void __spin_initlock(struct spinlock *lk, char *name);
+// Static initializer for a struct spinlock.
+#ifdef DEBUG_SPINLOCK
+#define SPINLOCK_INIT(lkname, lkrank)	{ .name = (lkname), .rank = (lkrank) }
+#else
+#define SPINLOCK_INIT(lkname, lkrank)	{ .name = (lkname) }
+#endif
+
+void __spin_initlock(struct spinlock *lk, char *name, int rank);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+void spin_assert_none_held(void);
+void spin_print_stats(int n);
 
-#define spin_initlock(lock)   __spin_initlock(lock, #lock)
-
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+#define spin_initlock(lock, rank)   __spin_initlock(lock, #lock, rank)
 
 #endif
@@ -12,6 +12,7 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/futex.h>
 #include <kern/e1000.h>
 
 // Print a string to the system console.
@@ -26,8 +27,17 @@ sys_cputs(const char *s, size_t len)
 
 	// LAB 3: Your code here.
 
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	// Print the string supplied by the user, through a kernel
+	// buffer in case another thread unmaps it meanwhile.
+	char buf[128];
+	size_t n;
+
+	for (; len > 0; s += n, len -= n) {
+		n = MIN(len, sizeof(buf));
+		if (user_copy_in(buf, s, n) < 0)
+			return;
+		cprintf("%.*s", n, buf);
+	}
 }
 
 // Read a character from the system console without blocking.
@@ -55,10 +65,21 @@ sys_env_destroy(envid_t envid)
 {
 	int r;
 	struct Env *e;
+	bool own;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &e, 1)) < 0) {
+		spin_unlock(&env_lock);
 		return r;
-	env_destroy(e);
+	}
+	if (e == curenv) {
+		spin_unlock(&env_lock);
+		env_destroy(e);		// does not return
+	}
+	own = env_mark_dying(e);
+	spin_unlock(&env_lock);
+	if (own)
+		env_free(e);
 	return 0;
 }
 
@@ -89,12 +110,76 @@ sys_exofork(void)
 	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_tf = curenv->env_tf;
 	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_priority = curenv->env_priority;
+	e->env_vruntime = curenv->env_vruntime;
 	
 	return e->env_id;
 	
 	//panic("sys_exofork not implemented");
 }
 
+// Fork the current environment, sharing its memory copy-on-write.
+// Unlike sys_exofork, the child is complete and already runnable.
+//
+// Returns the child's envid to the parent and 0 to the child, or < 0
+// on error (see env_fork).
+static envid_t
+sys_fork(void)
+{
+	struct Env *e;
+	envid_t envid;
+	int r;
+
+	if ((r = env_fork(curenv, &e)) < 0)
+		return r;
+	envid = e->env_id;
+	sched_wakeup(e);
+	return envid;
+}
+
+// Start a thread that shares the current environment's memory, running
+// from eip with its stack pointer at esp, and with the exception stack
+// ending at xstacktop, already mapped.  The thread does not return
+// from this call: the caller builds its initial stack.
+//
+// Returns the child's envid, or < 0 on error (see env_sfork).
+static envid_t
+sys_sfork(uintptr_t eip, uintptr_t esp, uintptr_t xstacktop)
+{
+	struct Env *e;
+	envid_t envid;
+	int r;
+
+	if ((r = env_sfork(curenv, eip, esp, xstacktop, &e)) < 0)
+		return r;
+	envid = e->env_id;
+	sched_wakeup(e);
+	return envid;
+}
+
+// Block until sys_futex_wake on addr, if *addr == val, for at most
+// usec microseconds, or for good if usec is 0.
+//
+// Returns 0 when woken or if *addr != val, -E_TIMEOUT on timeout, or
+// < 0 on error.  Errors are:
+//	-E_INVAL if addr is above UTOP or not 4-byte aligned.
+//	-E_FAULT if addr is not mapped.
+static int
+sys_futex_wait(const uint32_t *addr, uint32_t val, uint32_t usec)
+{
+	return futex_wait(addr, val, usec);
+}
+
+// Wake up to n environments blocked in sys_futex_wait on addr, in any
+// address space that maps the same page.
+//
+// Returns the number woken, or < 0 on error (see sys_futex_wait).
+static int
+sys_futex_wake(const uint32_t *addr, int n)
+{
+	return futex_wake(addr, n);
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -114,12 +199,26 @@ sys_env_set_status(envid_t envid, int status)
 	// LAB 4: Your code here.
 	struct Env * env ;
 	int ret ;
-	if((ret = envid2env(envid, &env, 1)) < 0) return ret ;
-	if ((status == ENV_NOT_RUNNABLE) || (status == ENV_RUNNABLE)) {
-		env->env_status = status ;
-		return 0 ;
+	if ((status != ENV_NOT_RUNNABLE) && (status != ENV_RUNNABLE))
+		return -E_INVAL ;
+	spin_lock(&env_lock);
+	if((ret = envid2env(envid, &env, 1)) < 0) {
+		spin_unlock(&env_lock);
+		return ret ;
+	}
+	if (status == ENV_RUNNABLE)
+		sched_wakeup(env);
+	else if (env == curenv) {
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		sched_block(&env_lock);
+	} else if (cmpxchg(&env->env_status, ENV_RUNNABLE, ENV_NOT_RUNNABLE)
+		   == ENV_RUNNING) {
+		// Running on another CPU; we cannot pull it off from here.
+		spin_unlock(&env_lock);
+		return -E_INVAL ;
 	}
-	return -E_INVAL ;
+	spin_unlock(&env_lock);
+	return 0 ;
 	//panic("sys_env_set_status not implemented");
 }
 
@@ -137,13 +236,21 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	// Remember to check whether the user has supplied us with a good
 	// address!
 	struct Env *e;
+	struct Trapframe ktf;
 	int ret;
-	if ((ret = envid2env(envid, &e, 1)) < 0) return ret;
-	if ((tf->tf_eip >= UTOP)) 
+	if ((ret = user_copy_in(&ktf, tf, sizeof(ktf))) < 0)
+		return ret;
+	if ((ktf.tf_eip >= UTOP)) 
         return -1;
+	spin_lock(&env_lock);
+	if ((ret = envid2env(envid, &e, 1)) < 0) {
+		spin_unlock(&env_lock);
+		return ret;
+	}
 
-    	e->env_tf = *tf;
+    	e->env_tf = ktf;
     	e->env_tf.tf_eflags |= FL_IF;
+	spin_unlock(&env_lock);
     	return 0;
 }
 
@@ -160,14 +267,48 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 {
 	struct Env* env;
 	int ret;
-	if( (ret = envid2env(envid,&env, 1)) < 0) return ret;
 	if( !func ) return -E_INVAL;
+	spin_lock(&env_lock);
+	if( (ret = envid2env(envid,&env, 1)) < 0) {
+		spin_unlock(&env_lock);
+		return ret;
+	}
 	env->env_pgfault_upcall = func;
+	spin_unlock(&env_lock);
 	user_mem_assert(env, func, 4, 0);
 	return 0;
 	//panic("sys_env_set_pgfault_upcall not implemented");
 }
 
+// Set envid's scheduling priority (see ENV_PRIO_* in inc/env.h).
+// The change takes effect the next time envid is queued to run.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if priority is neither a nice value nor an RT priority,
+//		or it is an RT priority and the caller is an ordinary
+//		environment rather than the file or network server.
+static int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	struct Env *env;
+	int ret;
+
+	if (!(priority >= ENV_PRIO_NICE_MIN && priority <= ENV_PRIO_NICE_MAX) &&
+	    !(priority >= ENV_PRIO_RT_MIN && priority <= ENV_PRIO_RT_MAX))
+		return -E_INVAL;
+	// A real-time spinner would starve the servers, and with them
+	// everyone else.
+	if (ENV_PRIO_IS_RT(priority) && curenv->env_type == ENV_TYPE_USER)
+		return -E_INVAL;
+	spin_lock(&env_lock);
+	if ((ret = envid2env(envid, &env, 1)) == 0)
+		env->env_priority = priority;
+	spin_unlock(&env_lock);
+	return ret;
+}
+
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
 // The page's contents are set to 0.
@@ -202,7 +343,6 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	// to translate an envid to a struct Env.
 	// check whether the current environment has permission to set
 	// envid's status.
-	if((ret = envid2env(envid, &env, 1)) < 0) return ret ;
 	//	-E_INVAL if perm is inappropriate (see above).
 	if (perm & ~PTE_SYSCALL) return -E_INVAL ;
 	if (!(perm & (PTE_U|PTE_P))) return -E_INVAL;
@@ -210,24 +350,68 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	if ((uintptr_t)va >= UTOP || PGOFF(va)) return -E_INVAL ;
 	// allocate a new page.
 	if (!(pp = page_alloc(ALLOC_ZERO))) return -E_NO_MEM ;
+	spin_lock(&pmap_lock);
+	if((ret = envid2env(envid, &env, 1)) < 0) goto fail;
 	// insert new page into env's pgdir
-	if ((ret = page_insert(env->env_pgdir, pp, va, perm)) < 0) {
-		// free up when it failed.
-		page_free(pp) ;
-		return ret;
-	}
-	// initialise the new page
-	memset(page2kva(pp), 0, PGSIZE) ;
+	if ((ret = page_insert(env->env_pgdir, pp, va, perm)) < 0) goto fail;
+	spin_unlock(&pmap_lock);
 	return 0 ;
+
+fail:
+	// free up when it failed.
+	spin_unlock(&pmap_lock);
+	page_free(pp) ;
+	return ret;
 	//panic("sys_page_alloc not implemented");
 }
 
+// Allocate a zeroed, physically contiguous 4MB region and map it with a
+// single 4MB page at 'va' in the address space of 'envid', replacing
+// whatever was mapped in [va, va+PTSIZE).  Unmapping any page of the
+// region with sys_page_unmap unmaps all of it.  Perm is as in
+// sys_page_alloc.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not 4MB-aligned.
+//	-E_INVAL if perm is inappropriate, or the CPU has no 4MB pages.
+//	-E_NO_MEM if there is no free 4MB of physical memory.
+static int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	struct Env *env;
+	struct PageInfo *pp;
+	int ret;
+
+	if (perm & ~PTE_SYSCALL) return -E_INVAL;
+	if (!(perm & (PTE_U|PTE_P))) return -E_INVAL;
+	if ((uintptr_t)va >= UTOP || (uintptr_t)va % PTSIZE) return -E_INVAL;
+	if (!page_pse) return -E_INVAL;
+	if (!(pp = page_alloc_order(PAGE_MAX_ORDER, ALLOC_ZERO)))
+		return -E_NO_MEM;
+	spin_lock(&pmap_lock);
+	if ((ret = envid2env(envid, &env, 1)) < 0) goto fail;
+	if ((ret = page_insert_large(env->env_pgdir, pp, va, perm)) < 0) goto fail;
+	spin_unlock(&pmap_lock);
+	return 0;
+
+fail:
+	spin_unlock(&pmap_lock);
+	page_free_order(pp, PAGE_MAX_ORDER);
+	return ret;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
 // that it also must not grant write access to a read-only
 // page.
 //
+// If srcva is the start of a 4MB page and dstva is 4MB-aligned, the
+// whole 4MB page is mapped at dstva.  Otherwise a single page of it
+// can be mapped like any other.
+//
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
 //		or the caller doesn't have permission to change one of them.
@@ -254,23 +438,37 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	pte_t * pte ;
 	struct PageInfo * pp ;
 	int ret ;
-	//	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
-	//	or the caller doesn't have permission to change one of them.
-	if ((ret = envid2env(srcenvid, &src_env, 1)) < 0) { return ret ; }
-	if ((ret = envid2env(dstenvid, &dst_env, 1)) < 0) { return ret ; }
 	//	-E_INVAL if srcva >= UTOP or srcva is not page-aligned,
 	//	or dstva >= UTOP or dstva is not page-aligned.
 	if ((uintptr_t)srcva >= UTOP || PGOFF(srcva)) { return -E_INVAL ; }
 	if ((uintptr_t)dstva >= UTOP || PGOFF(dstva)) { return -E_INVAL ; }
-	//	-E_INVAL is srcva is not mapped in srcenvid's address space.
-	if (!(pp = page_lookup(src_env->env_pgdir, srcva, &pte))) { return -E_INVAL ; }
 	//	-E_INVAL if perm is inappropriate (see above).
 	if (perm & ~PTE_SYSCALL) { return -E_INVAL ; }
+	spin_lock(&pmap_lock);
+	//	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
+	//	or the caller doesn't have permission to change one of them.
+	if ((ret = envid2env(srcenvid, &src_env, 1)) < 0) goto out;
+	if ((ret = envid2env(dstenvid, &dst_env, 1)) < 0) goto out;
+	// Only a private page table tells which pages are copy-on-write.
+	if ((perm & PTE_W) &&
+	    (ret = pgdir_unshare(src_env->env_pgdir, srcva)) < 0) goto out;
+	//	-E_INVAL is srcva is not mapped in srcenvid's address space,
+	//	or is one of the NIC's pages (see sys_net_map).
+	ret = -E_INVAL;
+	if (e1000_mapped(src_env->env_pgdir, (uintptr_t) srcva, PGSIZE)) goto out;
+	if (!(pp = page_lookup(src_env->env_pgdir, srcva, &pte))) goto out;
 	//	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 	//	address space.
-	if ((perm & PTE_W) && !(*pte & PTE_W)) { return -E_INVAL ; }
+	if ((perm & PTE_W) && !(*pte & PTE_W)) goto out;
 	// insert into dst_env's pgdir.
-	return page_insert(dst_env->env_pgdir, pp, dstva, perm) ;
+	if ((*pte & PTE_PS) && (uintptr_t)srcva % PTSIZE == 0 &&
+	    (uintptr_t)dstva % PTSIZE == 0)
+		ret = page_insert_large(dst_env->env_pgdir, pp, dstva, perm);
+	else
+		ret = page_insert(dst_env->env_pgdir, pp, dstva, perm) ;
+out:
+	spin_unlock(&pmap_lock);
+	return ret ;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -291,14 +489,142 @@ sys_page_unmap(envid_t envid, void *va)
 	struct PageInfo * pp ;
 	int ret ;
 
-	if ((ret = envid2env(envid, &env, 1))) return ret ;
 	if ((uintptr_t)va >= UTOP || PGOFF(va)) return -E_INVAL ;
-	if (!(pp = page_lookup(env->env_pgdir, va, &pte))) return 0;
+	spin_lock(&pmap_lock);
+	if ((ret = envid2env(envid, &env, 1))) {
+		spin_unlock(&pmap_lock);
+		return ret ;
+	}
+	if ((pp = page_lookup(env->env_pgdir, va, &pte)))
+		page_remove(env->env_pgdir, va) ;
+	spin_unlock(&pmap_lock);
+	return 0;
+}
 
-	page_remove(env->env_pgdir, va) ;
+// Whether dst will take a message from src right now.  An env blocked
+// in sys_ipc_call only accepts the reply from the env it called, or
+// from one of its threads.  Called with ipc_lock held.
+static bool
+ipc_can_recv(struct Env *dst, struct Env *src)
+{
+	return dst->env_ipc_recving &&
+		(!dst->env_ipc_callee || dst->env_ipc_callee == src ||
+		 dst->env_ipc_callee->env_pgdir == src->env_pgdir);
+}
+
+// Deliver 'value' (and the page at 'srcva' in src, if any) to dst,
+// which must be receiving.  On success dst stops receiving; the
+// caller wakes it.  Called with ipc_lock held.
+static int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value, void *srcva,
+	    unsigned perm)
+{
+	pte_t *pte;
+	struct PageInfo *page;
+
+	dst->env_ipc_perm = 0;
+	if ((uint32_t) dst->env_ipc_dstva < UTOP && (uint32_t) srcva < UTOP) {
+		if (PGOFF(srcva) || (perm & ~PTE_SYSCALL))
+			return -E_INVAL;
+		spin_lock(&pmap_lock);
+		if ((perm & PTE_W) && pgdir_unshare(src->env_pgdir, srcva) < 0) {
+			spin_unlock(&pmap_lock);
+			return -E_NO_MEM;
+		}
+		page = page_lookup(src->env_pgdir, srcva, &pte);
+		if (!page || ((perm & PTE_W) && (*pte & PTE_W) == 0) ||
+		    e1000_mapped(src->env_pgdir, (uintptr_t) srcva, PGSIZE)) {
+			spin_unlock(&pmap_lock);
+			return -E_INVAL;
+		}
+		if (page_insert(dst->env_pgdir, page, dst->env_ipc_dstva, perm) < 0) {
+			spin_unlock(&pmap_lock);
+			return -E_NO_MEM;
+		}
+		spin_unlock(&pmap_lock);
+		dst->env_ipc_perm = perm;
+	}
+
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_value = value;
+	dst->env_ipc_recving = false;
+	env_ipc_set_callee(dst, NULL);
 	return 0;
 }
 
+// dst has just been handed a message by curenv and is blocked but no
+// longer receiving, so only we can wake it.  Either make it runnable,
+// or, if the sender asked to donate, switch to it right away with
+// curenv's system call returning 0.  Called with ipc_lock held;
+// releases it.
+static void
+ipc_woken(struct Env *dst, bool donate)
+{
+	if (donate) {
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		sched_handoff(&ipc_lock, dst);
+		return;
+	}
+	sched_wakeup(dst);
+	spin_unlock(&ipc_lock);
+}
+
+// Put curenv at the tail of dst's sender queue.
+// Called with ipc_lock held.
+static void
+ipc_enqueue(struct Env *dst, uint32_t value, void *srcva, unsigned perm,
+	    bool call)
+{
+	curenv->env_ipc_send_to = dst;
+	curenv->env_ipc_send_value = value;
+	curenv->env_ipc_send_srcva = srcva;
+	curenv->env_ipc_send_perm = perm;
+	curenv->env_ipc_send_call = call;
+	curenv->env_ipc_send_link = NULL;
+	if (dst->env_ipc_sendq_tail)
+		dst->env_ipc_sendq_tail->env_ipc_send_link = curenv;
+	else
+		dst->env_ipc_sendq_head = curenv;
+	dst->env_ipc_sendq_tail = curenv;
+}
+
+// Receive into dstva: take the oldest queued sender if there is one,
+// otherwise block.  If next is non-null, it has just been handed a
+// message and is switched to directly if curenv blocks.
+// Called with ipc_lock held; releases it.
+static int
+ipc_wait(void *dstva, struct Env *next)
+{
+	struct Env *s;
+	int r;
+
+	curenv->env_ipc_recving = true;
+	curenv->env_ipc_dstva = dstva;
+	env_ipc_set_callee(curenv, NULL);
+	while ((s = curenv->env_ipc_sendq_head) != NULL) {
+		if (!(curenv->env_ipc_sendq_head = s->env_ipc_send_link))
+			curenv->env_ipc_sendq_tail = NULL;
+		s->env_ipc_send_to = NULL;
+		r = ipc_deliver(s, curenv, s->env_ipc_send_value,
+				s->env_ipc_send_srcva, s->env_ipc_send_perm);
+		if (r < 0 || !s->env_ipc_send_call) {
+			// A successful caller stays blocked for our reply.
+			s->env_ipc_recving = false;
+			env_ipc_set_callee(s, NULL);
+			s->env_tf.tf_regs.reg_eax = r;
+			sched_wakeup(s);
+		}
+		if (r == 0) {
+			if (next)
+				sched_wakeup(next);
+			spin_unlock(&ipc_lock);
+			return 0;
+		}
+	}
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_block_to(&ipc_lock, next);
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -332,39 +658,76 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
 //	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
-//		address space.
+//		address space, or is one of the NIC's pages (see
+//		sys_net_map).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
+//
+// With IPC_DONATE in perm, a successful send runs the receiver at once
+// (see ipc_woken).
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
 	struct Env *env;
-	pte_t * pte ;
-	struct PageInfo * page ;
+	bool donate = perm & IPC_DONATE;
 	int ret ;
-	if ((ret = envid2env(envid, &env, 0)) < 0) { return ret ; }
-	if (!env->env_ipc_recving) return -E_IPC_NOT_RECV;
-	env->env_ipc_perm = 0;
+	perm &= ~IPC_DONATE;
+	spin_lock(&ipc_lock);
+	if ((ret = envid2env(envid, &env, 0)) < 0) goto out;
+	ret = -E_IPC_NOT_RECV;
+	if (!ipc_can_recv(env, curenv)) goto out;
+	if ((ret = ipc_deliver(curenv, env, value, srcva, perm)) == 0) {
+		ipc_woken(env, donate);
+		return 0;
+	}
+out:
+	spin_unlock(&ipc_lock);
+	return ret;
 	
-	if ((uint32_t) env->env_ipc_dstva < UTOP && (uint32_t) srcva < UTOP) { 
-		if (PGOFF(srcva)) return -E_INVAL ; 
-		if (perm & ~PTE_SYSCALL) return -E_INVAL ; 
-		page = page_lookup(curenv->env_pgdir, srcva, &pte);
-		if (!page) return -E_INVAL;
-		if ((perm & PTE_W) && (*pte & PTE_W) == 0) return -E_INVAL;
-		if ((page_insert(env->env_pgdir, page, env->env_ipc_dstva, perm)) < 0) return -E_NO_MEM;
-		env->env_ipc_perm = perm;
+}
+
+// Like sys_ipc_try_send, but if the target is not receiving, block
+// on its sender queue instead of failing with -E_IPC_NOT_RECV.
+// Queued senders are served in FIFO order by sys_ipc_recv, which
+// wakes the sender with the result of the delivery.  IPC_DONATE only
+// applies when the target was already receiving.
+//
+// Errors are those of sys_ipc_try_send, except -E_IPC_NOT_RECV, plus:
+//	-E_INVAL if envid is the caller itself and it is not receiving.
+//	-E_BAD_ENV if the target is destroyed while we are queued.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *env;
+	bool donate = perm & IPC_DONATE;
+	int ret;
+
+	perm &= ~IPC_DONATE;
+	if ((uint32_t) srcva < UTOP && (PGOFF(srcva) || (perm & ~PTE_SYSCALL)))
+		return -E_INVAL;
+
+	spin_lock(&ipc_lock);
+	if ((ret = envid2env(envid, &env, 0)) < 0)
+		goto out;
+	if (ipc_can_recv(env, curenv)) {
+		if ((ret = ipc_deliver(curenv, env, value, srcva, perm)) < 0)
+			goto out;
+		ipc_woken(env, donate);
+		return 0;
 	}
+	ret = -E_INVAL;
+	if (env == curenv)
+		goto out;
 
-	env->env_ipc_from = curenv->env_id;
-    	env->env_ipc_value = value;
-    	env->env_ipc_recving = false;
-	env->env_status = ENV_RUNNABLE;
-	return 0;
-	
+	ipc_enqueue(env, value, srcva, perm, false);
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_block(&ipc_lock);
+out:
+	spin_unlock(&ipc_lock);
+	return ret;
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -374,6 +737,10 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If senders are already queued in sys_ipc_send, take the oldest one
+// and return at once.  A queued send that fails is reported to its
+// sender and the next one is tried.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
@@ -383,12 +750,88 @@ sys_ipc_recv(void *dstva)
 {
 	// LAB 4: Your code here.
 	if( (uint32_t) dstva < UTOP && PGOFF(dstva) ) return -E_INVAL;
+	spin_lock(&ipc_lock);
+	return ipc_wait(dstva, NULL);
+}
+
+// Send a request to envid and block until envid replies, as one
+// operation.  The request is delivered as by sys_ipc_send; if envid
+// is already receiving, the CPU is handed to it directly.  The reply
+// arrives as for sys_ipc_recv(dstva), and only envid can send it.
+//
+// Returns 0 once the reply is in, < 0 on error.  Errors are those of
+// sys_ipc_send, plus:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_BAD_ENV if envid is destroyed before it replies.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	     void *dstva)
+{
+	struct Env *env, *next = NULL;
+	int ret;
+
+	if ((uint32_t) srcva < UTOP && (PGOFF(srcva) || (perm & ~PTE_SYSCALL)))
+		return -E_INVAL;
+	if ((uint32_t) dstva < UTOP && PGOFF(dstva))
+		return -E_INVAL;
+
+	spin_lock(&ipc_lock);
+	if ((ret = envid2env(envid, &env, 0)) < 0)
+		goto out;
+	ret = -E_INVAL;
+	if (env == curenv)
+		goto out;
+
+	if (ipc_can_recv(env, curenv)) {
+		if ((ret = ipc_deliver(curenv, env, value, srcva, perm)) < 0)
+			goto out;
+		next = env;
+	} else
+		ipc_enqueue(env, value, srcva, perm, true);
+
 	curenv->env_ipc_recving = true;
 	curenv->env_ipc_dstva = dstva;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	env_ipc_set_callee(curenv, env);
 	curenv->env_tf.tf_regs.reg_eax = 0;
-	sched_yield();
-	return 0;
+	sched_block_to(&ipc_lock, next);
+out:
+	spin_unlock(&ipc_lock);
+	return ret;
+}
+
+// Reply to envid, if envid is non-zero, then wait for the next
+// message as sys_ipc_recv(dstva) would.  The reply never blocks: it
+// fails with -E_IPC_NOT_RECV, without waiting, unless envid is
+// receiving (normally, blocked in sys_ipc_call to us).  When the
+// reply goes through and no other sender is queued, the CPU is handed
+// straight to envid.
+//
+// Errors from the reply are those of sys_ipc_try_send, plus
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		   void *dstva)
+{
+	struct Env *env = NULL;
+	int ret;
+
+	if ((uint32_t) dstva < UTOP && PGOFF(dstva))
+		return -E_INVAL;
+
+	spin_lock(&ipc_lock);
+	if (envid) {
+		if ((ret = envid2env(envid, &env, 0)) < 0)
+			goto out;
+		ret = -E_IPC_NOT_RECV;
+		if (env == curenv || !ipc_can_recv(env, curenv))
+			goto out;
+		if ((ret = ipc_deliver(curenv, env, value, srcva, perm)) < 0)
+			goto out;
+	}
+	return ipc_wait(dstva, env);
+out:
+	spin_unlock(&ipc_lock);
+	return ret;
 }
 
 // Return the current time.
@@ -399,6 +842,20 @@ sys_time_msec(void)
 	return time_msec();
 }
 
+// Return microseconds since boot, modulo 2^32.
+static uint32_t
+sys_time_usec(void)
+{
+	return time_usec();
+}
+
+// Block for at least usec microseconds.  Always returns 0.
+static int
+sys_sleep_usec(uint32_t usec)
+{
+	time_sleep(usec);
+}
+
 static int 
 sys_net_output(const char* va, int len) {
 	if( (uint32_t) va >= UTOP ) return -E_INVAL;
@@ -411,6 +868,212 @@ sys_net_input(char* va, int* len) {
 	return e1000_receive(va, len);
 }
 
+// Receive a packet into va, storing its length in *len, as
+// sys_net_input does, but sleep until a packet comes in if there is
+// none.  After sleeping, returns -E_NO_FREE; the caller should then
+// try again.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_FREE if there was no packet (see above), or another
+//		environment is already waiting for one.
+// Destroys the environment if va or len is not writable user memory.
+static int
+sys_net_recv(char *va, int *len)
+{
+	user_mem_assert(curenv, va, RX_PKTSIZE, PTE_U | PTE_W);
+	user_mem_assert(curenv, len, sizeof(*len), PTE_U | PTE_W);
+	return e1000_receive_wait(va, len);
+}
+
+// Map the page holding the next received packet at va, with
+// PTE_P|PTE_U|PTE_W, replacing whatever was mapped there.  The frame
+// starts NET_RXPAGE_DATA bytes into the page; the bytes in front of it
+// are free for the caller's use.  The NIC gets a fresh page in its
+// place, so the packet is never copied.  Sleeps if there is no packet,
+// as sys_net_recv does.
+//
+// Returns the frame's length on success, < 0 on error.  Errors are:
+//	-E_NO_FREE if there was no packet (see sys_net_recv).
+//	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if there's no memory to allocate a page table, or too
+//		many received pages are still mapped; sys_net_recv still
+//		works then.
+static int
+sys_net_recv_page(void *va)
+{
+	if ((uintptr_t) va >= UTOP || PGOFF(va))
+		return -E_INVAL;
+	return e1000_receive_page(va);
+}
+
+// Transmit the frames made of frags[0..nfrags) without copying them:
+// the last piece of each frame has NET_FRAG_EOP set, and the NIC reads
+// each piece straight from the caller's page, which stays allocated
+// until the NIC is done with it even if the caller unmaps it.  The
+// caller must not change the pieces until then, which it can tell from
+// the frame numbers stored in *seq (see struct NetTxSeq).  Frames are
+// queued in order, as many as fit in the transmit ring, with a single
+// write to the NIC's tail register.  With nfrags == 0, this only
+// stores *seq.
+//
+// Returns the number of frames queued, which may be 0 if the ring is
+// full, or < 0 on error.  Errors are:
+//	-E_INVAL if nfrags < 0 or nfrags > NET_BATCH_MAXFRAGS, or a piece
+//		is empty, crosses the end of its page, or is in a page
+//		that is not mapped, or a frame has more than NET_MAXFRAGS
+//		pieces, or the last piece does not end a frame.
+//	-E_PKT_LONG if a frame is too long.
+// Destroys the environment if frags or seq is not user memory.
+static int
+sys_net_send_batch(const struct NetFrag *frags, int nfrags,
+		   struct NetTxSeq *seq)
+{
+	struct NetFrag kfrags[NET_BATCH_MAXFRAGS];
+	struct NetTxSeq kseq;
+	int r;
+
+	if (nfrags < 0 || nfrags > NET_BATCH_MAXFRAGS)
+		return -E_INVAL;
+	user_mem_assert(curenv, frags, nfrags * sizeof(*frags), PTE_U);
+	user_mem_assert(curenv, seq, sizeof(*seq), PTE_U | PTE_W);
+	if (user_copy_in(kfrags, frags, nfrags * sizeof(*frags)) < 0)
+		return -E_FAULT;
+	if ((r = e1000_transmit_frags(kfrags, nfrags, &kseq)) >= 0 &&
+	    user_copy_out(seq, &kseq, sizeof(kseq)) < 0)
+		return -E_FAULT;
+	return r;
+}
+
+// Copy up to NET_BATCH_MAX received frames into the page at b, as a
+// struct NetBatch, handing their buffers back to the NIC all at once.
+// Frames longer than maxcopy are left for sys_net_recv_page, which is
+// cheaper for them.  Sleeps if there is no frame, as sys_net_recv does.
+//
+// Returns the number of frames copied, 0 if the next frame is longer
+// than maxcopy, or < 0 on error.  Errors are:
+//	-E_NO_FREE if there was no packet (see sys_net_recv).
+//	-E_INVAL if b is not page-aligned.
+// Destroys the environment if b is not a writable page of user memory.
+static int
+sys_net_recv_batch(struct NetBatch *b, int maxcopy)
+{
+	user_mem_assert(curenv, b, PGSIZE, PTE_U | PTE_W);
+	if (PGOFF(b))
+		return -E_INVAL;
+	return e1000_receive_batch(b, maxcopy);
+}
+
+// Map the NIC's descriptor rings and buffers at va, so that the caller
+// can send and receive by itself, telling the kernel with sys_net_sync;
+// see struct NetMap in inc/syscall.h.  The mappings belong to the
+// caller's address space alone: forked children do not get them, and
+// they cannot be passed on with sys_page_map or IPC.  The other network
+// calls fail with -E_BUSY until the last environment sharing that
+// address space exits.
+//
+// Returns the number of bytes mapped on success, < 0 on error.  Errors
+// are:
+//	-E_INVAL if va is not page-aligned, or the mapping would not fit
+//		below UTOP.
+//	-E_BUSY if the rings are already mapped.
+//	-E_NO_MEM if there's no memory to allocate a page table.
+static int
+sys_net_map(void *va)
+{
+	if (PGOFF(va) || (uintptr_t) va >= UTOP ||
+	    UTOP - (uintptr_t) va < E1000_MAPSIZE)
+		return -E_INVAL;
+	return e1000_map(va);
+}
+
+// Hand the NIC whatever the caller has done with the rings mapped by
+// sys_net_map since the last call, all with a single write to each
+// tail register.  If wait is set and there is no received frame to
+// look at, sleeps until one comes in.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_FREE after sleeping, when a frame has come in.
+//	-E_INVAL if the caller's address space does not have the rings.
+static int
+sys_net_sync(int wait)
+{
+	return e1000_sync(wait);
+}
+
+// Run one system call from a BatchRing, whose descriptor has been
+// copied into the kernel.
+static int
+batch_run(const struct SyscallDesc *sd)
+{
+	const uint32_t *a = sd->sd_args;
+
+	switch (sd->sd_num) {
+	case SYS_page_alloc:
+		return sys_page_alloc(a[0], (void*)a[1], a[2]);
+	case SYS_page_map:
+		return sys_page_map(a[0], (void*)a[1], a[2], (void*)a[3], a[4]);
+	case SYS_page_unmap:
+		return sys_page_unmap(a[0], (void*)a[1]);
+	case SYS_env_set_status:
+		return sys_env_set_status(a[0], a[1]);
+	case SYS_ipc_try_send:
+		return sys_ipc_try_send(a[0], a[1], (void*)a[2],
+					a[3] & ~IPC_DONATE);
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Run the system calls queued in 'ring' (see struct BatchRing in
+// inc/syscall.h), storing each result in its descriptor.  Batching
+// pays for one kernel entry instead of one per call.
+//
+// A call that blocks the caller (setting its own status to
+// ENV_NOT_RUNNABLE) ends the batch early; the descriptors after it stay
+// queued, and SYS_batch returns 0 when the caller is resumed.
+//
+// The queued calls, or another thread, may unmap the ring itself or
+// take away write access to it; the ring is only touched through
+// user_copy_in and user_copy_out, and the batch stops if it is gone.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if the ring holds more than BATCH_RING_SIZE descriptors.
+//	-E_FAULT if the ring was unmapped or made read-only during the
+//		batch; the result of the call that was running is lost.
+// Destroys the environment if the ring is not writable user memory.
+static int
+sys_batch(struct BatchRing *ring)
+{
+	struct SyscallDesc sd;
+	struct SyscallDesc *usd;
+	uint32_t head, tail;
+	int r;
+
+	user_mem_assert(curenv, ring, sizeof(*ring), PTE_U | PTE_W);
+	if (user_copy_in(&head, (void *) &ring->br_head, sizeof(head)) < 0 ||
+	    user_copy_in(&tail, (void *) &ring->br_tail, sizeof(tail)) < 0)
+		return -E_FAULT;
+	if (tail - head > BATCH_RING_SIZE)
+		return -E_INVAL;
+
+	while (head != tail) {
+		usd = &ring->br_desc[head % BATCH_RING_SIZE];
+		if (user_copy_in(&sd, usd, sizeof(sd)) < 0)
+			return -E_FAULT;
+		// Consume the descriptor first, in case it blocks us.
+		head++;
+		r = 0;
+		if (user_copy_out(&usd->sd_ret, &r, sizeof(r)) < 0 ||
+		    user_copy_out((void *) &ring->br_head, &head, sizeof(head)) < 0)
+			return -E_FAULT;
+
+		r = batch_run(&sd);
+		if (user_copy_out(&usd->sd_ret, &r, sizeof(r)) < 0)
+			return -E_FAULT;
+	}
+	return 0;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -436,10 +1099,28 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_env_set_pgfault_upcall : return sys_env_set_pgfault_upcall(a1, (void*)a2);
 	case SYS_ipc_try_send : return sys_ipc_try_send(a1, a2, (void*)a3, a4);
 	case SYS_ipc_recv : return sys_ipc_recv((void*)a1);
+	case SYS_env_set_priority : return sys_env_set_priority(a1, a2);
+	case SYS_page_alloc_large : return sys_page_alloc_large(a1, (void*)a2, a3);
+	case SYS_fork : return sys_fork();
+	case SYS_sfork : return sys_sfork(a1, a2, a3);
+	case SYS_futex_wait : return sys_futex_wait((const uint32_t*)a1, a2, a3);
+	case SYS_futex_wake : return sys_futex_wake((const uint32_t*)a1, a2);
+	case SYS_ipc_send : return sys_ipc_send(a1, a2, (void*)a3, a4);
+	case SYS_ipc_call : return sys_ipc_call(a1, a2, (void*)a3, a4, (void*)a5);
+	case SYS_ipc_reply_wait : return sys_ipc_reply_wait(a1, a2, (void*)a3, a4, (void*)a5);
 	case SYS_env_set_trapframe : return sys_env_set_trapframe(a1, (struct Trapframe*) a2);
 	case SYS_time_msec : return sys_time_msec();
+	case SYS_time_usec : return sys_time_usec();
+	case SYS_sleep_usec : return sys_sleep_usec(a1);
 	case SYS_net_output : return sys_net_output((const char*)a1, a2);
 	case SYS_net_input : return sys_net_input((char*)a1, (int*) a2);
+	case SYS_net_recv : return sys_net_recv((char*)a1, (int*) a2);
+	case SYS_net_recv_page : return sys_net_recv_page((void*)a1);
+	case SYS_net_send_batch : return sys_net_send_batch((const struct NetFrag*)a1, a2, (struct NetTxSeq*)a3);
+	case SYS_net_recv_batch : return sys_net_recv_batch((struct NetBatch*)a1, a2);
+	case SYS_net_map : return sys_net_map((void*)a1);
+	case SYS_net_sync : return sys_net_sync(a1);
+	case SYS_batch : return sys_batch((struct BatchRing*) a1);
 	default: return -E_INVAL;
 	}
 }
@@ -1,26 +1,165 @@
-#include <kern/time.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/time.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+#include <kern/futex.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
 
-static unsigned int ticks;
+// Time is kept by the TSC, whose rate lapic_init measures at boot.
+// There is no periodic tick: each CPU programs its LAPIC timer for the
+// next thing it has to do, either the end of the running environment's
+// quantum or the earliest sleeping environment's wakeup.
+
+static uint64_t tsc_boot;
+static uint64_t tsc_hz = 1000000000;	// Until calibrated
+
+struct spinlock timer_lock = SPINLOCK_INIT("timer_lock", LOCK_RANK_TIMER);
+static struct Env *sleepq;		// Sleeping envs by env_timeout
 
 void
 time_init(void)
 {
-	ticks = 0;
+	tsc_boot = read_tsc();
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
 void
-time_tick(void)
+time_calibrate(uint64_t hz)
+{
+	tsc_hz = hz;
+}
+
+static uint64_t
+tsc_to_usec(uint64_t tsc)
+{
+	return tsc / tsc_hz * 1000000 + tsc % tsc_hz * 1000000 / tsc_hz;
+}
+
+static uint64_t
+usec_to_tsc(uint64_t usec)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	return usec / 1000000 * tsc_hz + usec % 1000000 * tsc_hz / 1000000;
+}
+
+// Microseconds since boot.
+uint64_t
+time_usec(void)
+{
+	return tsc_to_usec(read_tsc() - tsc_boot);
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return time_usec() / 1000;
+}
+
+// Program this CPU's timer to fire at TSC 'deadline', or never if it
+// is ~0.
+static void
+timer_program(uint64_t deadline)
+{
+	uint64_t now = read_tsc(), usec;
+
+	thiscpu->cpu_timer_deadline = deadline;
+	if (deadline == ~0ULL) {
+		lapic_timer_oneshot(0);
+		return;
+	}
+	usec = deadline > now ? tsc_to_usec(deadline - now) : 0;
+	lapic_timer_oneshot(usec > 0xffffffff ? 0xffffffff : (usec ? usec : 1));
+}
+
+// Arm this CPU's timer for its next event: the earliest sleeper's
+// wakeup and, if 'quantum' is set, the end of a fresh scheduling
+// quantum for the environment about to run.
+void
+time_arm(bool quantum)
+{
+	uint64_t deadline = ~0ULL, q;
+
+	spin_lock(&timer_lock);
+	if (sleepq)
+		deadline = sleepq->env_timeout;
+	spin_unlock(&timer_lock);
+	if (quantum) {
+		q = read_tsc() + usec_to_tsc(SCHED_QUANTUM_USEC);
+		if (q < deadline)
+			deadline = q;
+	}
+	timer_program(deadline);
+}
+
+// Wake every sleeper whose deadline has passed.  Called on each timer
+// interrupt.
+void
+time_expire(void)
+{
+	uint64_t now = read_tsc();
+	struct Env *e;
+
+	spin_lock(&timer_lock);
+	while ((e = sleepq) != NULL && e->env_timeout <= now) {
+		sleepq = e->env_sleep_link;
+		e->env_timeout = 0;
+		futex_cancel(e);
+		sched_wakeup(e);
+	}
+	spin_unlock(&timer_lock);
+}
+
+// Put e on the sleep queue, to be woken in 'usec' microseconds.
+// Called with timer_lock held.
+void
+time_enqueue(struct Env *e, uint32_t usec)
+{
+	struct Env **pp;
+	uint64_t deadline = read_tsc() + usec_to_tsc(usec);
+
+	e->env_timeout = deadline;
+	for (pp = &sleepq; *pp && (*pp)->env_timeout <= deadline;
+	     pp = &(*pp)->env_sleep_link)
+		;
+	e->env_sleep_link = *pp;
+	*pp = e;
+	if (deadline < thiscpu->cpu_timer_deadline)
+		timer_program(deadline);
+}
+
+// Take e off the sleep queue, if it is on it.  Called with timer_lock
+// held.
+void
+time_dequeue(struct Env *e)
+{
+	struct Env **pp;
+
+	if (e->env_timeout) {
+		for (pp = &sleepq; *pp != e; pp = &(*pp)->env_sleep_link)
+			;
+		*pp = e->env_sleep_link;
+		e->env_timeout = 0;
+	}
+}
+
+// Block curenv for 'usec' microseconds.  Its system call returns 0
+// when it wakes.  Does not return.
+void
+time_sleep(uint32_t usec)
+{
+	spin_lock(&timer_lock);
+	time_enqueue(curenv, usec);
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_block(&timer_lock);
+}
+
+// Take e off the sleep queue and any futex wait queue.
+void
+time_cancel(struct Env *e)
+{
+	spin_lock(&timer_lock);
+	time_dequeue(e);
+	futex_cancel(e);
+	spin_unlock(&timer_lock);
 }
@@ -4,8 +4,23 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+struct Env;
+struct spinlock;
+
+// Protects the sleep queue, and the futex wait queues in kern/futex.c.
+extern struct spinlock timer_lock;
+
 void time_init(void);
-void time_tick(void);
+void time_calibrate(uint64_t tsc_hz);
+uint64_t time_usec(void);
 unsigned int time_msec(void);
+void time_arm(bool quantum);
+void time_expire(void);
+void time_sleep(uint32_t usec) __attribute__((noreturn));
+void time_enqueue(struct Env *e, uint32_t usec);
+void time_dequeue(struct Env *e);
+void time_cancel(struct Env *e);
 
 #endif /* JOS_KERN_TIME_H */
@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -14,6 +15,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/e1000.h>
 
 extern uint32_t trap_handlers[];
 
@@ -131,6 +133,17 @@ trap_init_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+	// Point sysenter at this CPU's kernel stack.  GD_KT also fixes
+	// the segments sysenter and sysexit load: GD_KD in the kernel,
+	// GD_UT and GD_UD in user mode.
+	if (sysenter_supported()) {
+		extern void sysenter_handler();
+
+		wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_IA32_SYSENTER_ESP, pts->ts_esp0);
+		wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t) sysenter_handler);
+	}
 }
 
 void
@@ -182,6 +195,15 @@ print_regs(struct PushRegs *regs)
 static void
 trap_dispatch(struct Trapframe *tf)
 {
+	// The e1000's IRQ line is only known once PCI has been scanned.
+	// It is usually on the slave 8259, which has no auto-EOI, so
+	// acknowledge it or no later e1000 interrupt gets through.
+	if (e1000_irq && tf->tf_trapno == IRQ_OFFSET + e1000_irq) {
+		irq_eoi();
+		e1000_intr();
+		return;
+	}
+
 	// Handle processor exceptions
 	switch(tf->tf_trapno) {
 	
@@ -212,7 +234,23 @@ trap_dispatch(struct Trapframe *tf)
 	// Handle keyboard and serial interrupts.
 	// LAB 5: Your code here.
 
-	case IRQ_OFFSET + IRQ_TIMER : { lapic_eoi(); time_tick(); sched_yield(); break; }
+	case IRQ_OFFSET + IRQ_TIMER : {
+		lapic_eoi();
+		time_expire();
+		time_arm(true);
+		sched_tick();
+		break;
+	}
+	case IRQ_OFFSET + IRQ_RESCHED : {
+		lapic_eoi();
+		sched_tick();
+		break;
+	}
+	case IRQ_OFFSET + IRQ_TLB : {
+		lapic_eoi();
+		tlb_shootdown_ack();
+		break;
+	}
 	case IRQ_OFFSET + IRQ_KBD : kbd_intr();break;
 	case IRQ_OFFSET + IRQ_SERIAL : serial_intr();break;
 	case IRQ_OFFSET + IRQ_IDE : print_trapframe(tf);break;
@@ -240,21 +278,16 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// Note that we are no longer halted in sched_halt(), if we were
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
-	//lock_kernel();
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-		lock_kernel();
+		// There is no big kernel lock: each kernel subsystem
+		// takes its own locks, so CPUs trap in concurrently.
 		assert(curenv);
 
 		// Garbage collect if current enviroment is a zombie
@@ -288,11 +321,27 @@ trap(struct Trapframe *tf)
 		sched_yield();
 }
 
+// Return from a trap taken in kernel mode to the code it interrupted,
+// on that code's stack.  The iret pops no %esp or %ss at the same
+// privilege level.
+static void
+trap_resume_kernel(struct Trapframe *tf)
+{
+	asm volatile("movl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\taddl $0x8,%%esp\n" /* skip tf_trapno and tf_errcode */
+		"\tiret"
+		: : "g" (tf) : "memory");
+	panic("iret failed");
+}
 
 void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	int r;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -301,10 +350,27 @@ page_fault_handler(struct Trapframe *tf)
 	// Handle kernel-mode page faults.
 
 	// LAB 3: Your code here.
-	// Panic in Kernel Mode
-	if ((tf->tf_cs & 3) == 0)
+	// A fault on user memory inside user_copy makes it return
+	// -E_FAULT; anything else in kernel mode is a kernel bug.
+	if ((tf->tf_cs & 3) == 0) {
+		if (thiscpu->cpu_ufixup && fault_va < UTOP) {
+			tf->tf_eip = thiscpu->cpu_ufixup;
+			tf->tf_regs.reg_eax = -E_FAULT;
+			thiscpu->cpu_ufixup = 0;
+			trap_resume_kernel(tf);
+		}
 		panic("page fault in kernel mode");
+	}
 		
+	// Copy-on-write faults are resolved here, with no upcall.
+	if ((tf->tf_err & FEC_WR) && fault_va < UTOP) {
+		spin_lock(&pmap_lock);
+		r = page_cow_fault(curenv->env_pgdir, (void *) fault_va);
+		spin_unlock(&pmap_lock);
+		if (r == 0)
+			return;
+	}
+
 
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
@@ -342,24 +408,29 @@ page_fault_handler(struct Trapframe *tf)
 	// Destroy the environment that caused the fault.
 	//print_trapframe(tf);
 	if(0 == curenv->env_pgfault_upcall) { goto Error; }
-	user_mem_assert(curenv, (void*)(UXSTACKTOP - sizeof(struct UTrapframe)), sizeof(struct UTrapframe), PTE_U|PTE_P|PTE_W);
+	// Threads made by sfork each have their own exception stack.
+	uintptr_t xstacktop = curenv->env_uxstacktop;
+	user_mem_assert(curenv, (void*)(xstacktop - sizeof(struct UTrapframe)), sizeof(struct UTrapframe), PTE_U|PTE_P|PTE_W);
 	uintptr_t exstack;
-	struct UTrapframe *utf;
+	struct UTrapframe *utf, kutf;
 	
 	// Figure out top where trapframe should end, leaving 1 word scratch space
-	if (tf->tf_esp >= UXSTACKTOP - PGSIZE && tf->tf_esp < UXSTACKTOP) exstack = tf->tf_esp - 4; 
-	else exstack = UXSTACKTOP;
+	if (tf->tf_esp >= xstacktop - PGSIZE && tf->tf_esp < xstacktop) exstack = tf->tf_esp - 4; 
+	else exstack = xstacktop;
 
 	// Check if enough space to copy trapframe
 	user_mem_assert(curenv, (void*)(exstack - sizeof(struct UTrapframe)), sizeof(struct UTrapframe), PTE_U|PTE_P|PTE_W);
 	
 	utf = (struct UTrapframe *) (exstack - sizeof(struct UTrapframe));
-	utf->utf_fault_va = fault_va;
-	utf->utf_err = tf->tf_err;
-	utf->utf_regs = tf->tf_regs;
-	utf->utf_eip = tf->tf_eip;
-	utf->utf_eflags = tf->tf_eflags;
-	utf->utf_esp = tf->tf_esp;
+	kutf.utf_fault_va = fault_va;
+	kutf.utf_err = tf->tf_err;
+	kutf.utf_regs = tf->tf_regs;
+	kutf.utf_eip = tf->tf_eip;
+	kutf.utf_eflags = tf->tf_eflags;
+	kutf.utf_esp = tf->tf_esp;
+	// Another thread may have unmapped the exception stack since.
+	if (user_copy_out(utf, &kutf, sizeof(kutf)) < 0)
+		goto Error;
 
 	tf->tf_esp = (uintptr_t) utf;	//change esp to exception stack
 	tf->tf_eip = (uintptr_t) curenv->env_pgfault_upcall; //change eip to pgfault handler
@@ -379,6 +450,49 @@ void breakpoint_handler(struct Trapframe *tf)
 	env_destroy(curenv);
 }
 
+// Called from sysenter_handler in trapentry.S with a Trapframe built
+// to look like an int $T_SYSCALL from user mode.  Returns only if the
+// caller can go straight back with sysexit, leaving the state to
+// resume in *tf; otherwise schedules and does not return.
+void
+sysenter_trap(struct Trapframe *tf)
+{
+	struct Trapframe *etf;
+
+	extern char *panicstr;
+	if (panicstr)
+		asm volatile("hlt");
+
+	assert(!(read_eflags() & FL_IF));
+	assert(curenv);
+
+	if (curenv->env_status == ENV_DYING) {
+		env_free(curenv);
+		curenv = NULL;
+		sched_yield();
+	}
+
+	curenv->env_tf = *tf;
+	etf = last_tf = &curenv->env_tf;
+
+	// %esi carried the return address, so there is no fifth argument.
+	etf->tf_regs.reg_eax = syscall(etf->tf_regs.reg_eax,
+				       etf->tf_regs.reg_edx,
+				       etf->tf_regs.reg_ecx,
+				       etf->tf_regs.reg_ebx,
+				       etf->tf_regs.reg_edi, 0);
+
+	// A syscall that blocked or switched environments has already
+	// left via sched_yield; one that made curenv unrunnable must
+	// leave now.  Otherwise resume curenv, which may have changed
+	// its own trapframe, from tf.
+	if (!curenv || curenv->env_status != ENV_RUNNING)
+		sched_yield();
+	spin_assert_none_held();
+	tlb_shootdown();
+	*tf = curenv->env_tf;
+}
+
 int32_t syscall_handler(struct Trapframe *tf) 
 {
 	//cprintf("\n[%08x] system call eip %08x cpu %d\n", curenv->env_id, tf->tf_eip, cpunum());
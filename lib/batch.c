@@ -0,0 +1,94 @@
+// Batched system calls.
+//
+// The batch_* functions queue system calls in this environment's
+// BatchRing instead of making them; batch_flush() runs everything
+// queued with a single SYS_batch.  Calls run in the order they were
+// queued, and a full ring is flushed automatically.
+
+#include <inc/lib.h>
+
+// Each thread queues in the ring in its own ThreadLocal, so threads
+// made by sfork never see each other's calls.  The error from a call
+// flushed early because the ring filled up is kept there as well, in
+// tl_batch_err, and reported by the next batch_flush().
+
+static int
+run_ring(struct BatchRing *ring)
+{
+	uint32_t i, head = ring->br_head;
+	int r, err = 0;
+
+	while (ring->br_head != ring->br_tail)
+		if ((r = sys_batch(ring)) < 0)
+			return r;
+	for (i = head; i != ring->br_tail; i++)
+		if (!err && ring->br_desc[i % BATCH_RING_SIZE].sd_ret < 0)
+			err = ring->br_desc[i % BATCH_RING_SIZE].sd_ret;
+	return err;
+}
+
+static void
+queue(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	struct ThreadLocal *tl = thread_local();
+	struct BatchRing *ring = &tl->tl_ring;
+	struct SyscallDesc *sd;
+	int r;
+
+	if (ring->br_tail - ring->br_head == BATCH_RING_SIZE)
+		if ((r = run_ring(ring)) < 0 && !tl->tl_batch_err)
+			tl->tl_batch_err = r;
+
+	sd = &ring->br_desc[ring->br_tail % BATCH_RING_SIZE];
+	sd->sd_num = num;
+	sd->sd_args[0] = a1;
+	sd->sd_args[1] = a2;
+	sd->sd_args[2] = a3;
+	sd->sd_args[3] = a4;
+	sd->sd_args[4] = a5;
+	ring->br_tail++;
+}
+
+void
+batch_page_alloc(envid_t envid, void *va, int perm)
+{
+	queue(SYS_page_alloc, envid, (uint32_t) va, perm, 0, 0);
+}
+
+void
+batch_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
+{
+	queue(SYS_page_map, srcenv, (uint32_t) srcva, dstenv, (uint32_t) dstva, perm);
+}
+
+void
+batch_page_unmap(envid_t envid, void *va)
+{
+	queue(SYS_page_unmap, envid, (uint32_t) va, 0, 0, 0);
+}
+
+void
+batch_env_set_status(envid_t envid, int status)
+{
+	queue(SYS_env_set_status, envid, status, 0, 0, 0);
+}
+
+void
+batch_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	queue(SYS_ipc_try_send, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+// Run every queued system call.
+// Returns 0 if all of them succeeded, otherwise the first error.
+int
+batch_flush(void)
+{
+	struct ThreadLocal *tl = thread_local();
+	int r, err;
+
+	r = run_ring(&tl->tl_ring);
+	err = tl->tl_batch_err;
+	tl->tl_batch_err = 0;
+	return err < 0 ? err : r;
+}
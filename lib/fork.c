@@ -3,10 +3,6 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -51,33 +47,84 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
+// The mappings are queued with batch_page_map(); the caller must
+// batch_flush() and check for errors.
 //
-static int
+static void
 duppage(envid_t envid, unsigned pn)
 {
-	int r;
-
 	// LAB 4: Your code here.
 	void *va = (void *)(pn << PGSHIFT);
 	int perm = PTE_U | PTE_P;
 	if ( uvpt[pn] & PTE_SHARE ) {
-		if ((r = sys_page_map(0, va, envid, va, PGOFF(va) | PTE_SYSCALL)) < 0)
-		panic("error in duppage(), sys_page_map: %e\n", r);
+		batch_page_map(0, va, envid, va, PGOFF(va) | PTE_SYSCALL);
 	}
 	else {
 	if ((uvpt[pn] & PTE_W) || (uvpt[pn] & PTE_COW)) perm |= PTE_COW;
+	batch_page_map(0, va, envid, va, perm);
+	batch_page_map(0, va, 0, va, perm);
+	}
+}
+
+//
+// Like duppage, but with direct system calls rather than the batch, for
+// the page holding the BatchRing itself.  Returns 0 or < 0 on error.
+//
+static int
+duppage_now(envid_t envid, unsigned pn)
+{
+	void *va = (void *) (pn << PGSHIFT);
+	int perm = PTE_U | PTE_P;
+	int r;
+
+	if (uvpt[pn] & PTE_SHARE)
+		return sys_page_map(0, va, envid, va, uvpt[pn] & PTE_SYSCALL);
+	if (uvpt[pn] & (PTE_W | PTE_COW))
+		perm |= PTE_COW;
 	if ((r = sys_page_map(0, va, envid, va, perm)) < 0)
-		panic("error in duppage(), sys_page_map: %e\n", r);
-	if ((r = sys_page_map(0, va, 0, va, perm)) < 0)
-		panic("error in duppage(), sys_page_map: %e\n", r);
+		return r;
+	return sys_page_map(0, va, 0, va, perm);
+}
+
+//
+// Like duppage, for the 4MB page that page directory entry pdx maps.
+// The kernel splits a copy-on-write 4MB page into 4KB pages on the
+// first write, and copies only the page written.
+//
+static void
+duppage_large(envid_t envid, unsigned pdx)
+{
+	void *va = PGADDR(pdx, 0, 0);
+	int perm = uvpd[pdx] & PTE_SYSCALL;
+
+	if (uvpd[pdx] & PTE_SHARE) {
+		batch_page_map(0, va, envid, va, perm);
+		return;
 	}
-	return 0;
+	if (perm & (PTE_W | PTE_COW))
+		perm = (perm & ~PTE_W) | PTE_COW;
+	batch_page_map(0, va, envid, va, perm);
+	batch_page_map(0, va, 0, va, perm);
+}
+
+//
+// Fork with copy-on-write, done by the kernel in one system call.
+// Copy-on-write faults are resolved by the kernel too.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+	envid_t envid;
+
+	if ((envid = sys_fork()) == 0)
+		thisenv = &envs[ENVX(sys_getenvid())];
+	return envid;
 }
 
 //
-// User-level fork with copy-on-write.
+// User-level fork with copy-on-write, kept to compare against fork.
 // Set up our page fault handler appropriately.
 // Create a child.
 // Copy our address space and page fault handler setup to the child.
@@ -93,7 +140,7 @@ duppage(envid_t envid, unsigned pn)
 //   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
-fork(void)
+ufork(void)
 {
 	// LAB 4: Your code here.
 	extern void _pgfault_upcall(void);
@@ -105,29 +152,120 @@ fork(void)
 		return 0;
 	}
 	uint32_t pn = PGNUM(UTEXT), r;
+	// The page holding our BatchRing has to stay writable until the
+	// kernel is done with the batch, so it is mapped last, directly.
+	uint32_t ringpn = PGNUM(&thread_local()->tl_ring);
+	// The upcall must be in place before the child can run; everything
+	// else goes out in as few SYS_batch calls as the ring allows.
+	if ((r = sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall)) < 0)
+		panic("sys_env_set_pgfault_upcall: error %e\n", r);
 	for ( ; pn < PGNUM(UTOP); pn++){
 		if (!(uvpd[PDX(pn << PGSHIFT)] & PTE_P)) continue;
+		if (uvpd[PDX(pn << PGSHIFT)] & PTE_PS) {
+			duppage_large(envid, PDX(pn << PGSHIFT));
+			pn += NPTENTRIES - 1;
+			continue;
+		}
 		if (!(uvpt[pn] & PTE_P)) continue;
-		if ((pn << PGSHIFT) < UXSTACKTOP - PGSIZE){
+		if ((pn << PGSHIFT) < UXSTACKTOP - PGSIZE && pn != ringpn){
 			duppage(envid, pn);
 		}
 	}
 
-	if ((r = sys_page_alloc(envid, (void*)(UXSTACKTOP-PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
-		panic("sys_page_alloc: error %e\n", r);
-	if ((r = sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall)) < 0)
-		panic("sys_env_set_pgfault_upcall: error %e\n", r);
-	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0) 
+	batch_page_alloc(envid, (void*)(UXSTACKTOP-PGSIZE), PTE_P | PTE_U | PTE_W);
+	if ((r = batch_flush()) < 0)
+		panic("fork: batch_flush: error %e\n", r);
+	if ((r = duppage_now(envid, ringpn)) < 0)
+		panic("fork: duppage_now: error %e\n", r);
+	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
 		panic("sys_env_set_status: error %e\n", r);
 
 	return envid;	
 	
 }
 
-// Challenge!
-int
-sfork(void)
+// Thread slot owners (see inc/lib.h): the envid of the thread using
+// each slot, -1 while sfork is claiming it, or 0.  Slot 0 is the main
+// thread's and is never handed out.
+static volatile envid_t slot_owner[THREAD_NSLOTS];
+
+// Claim a slot whose owner is gone.  Returns its number, or -E_NO_MEM.
+static int
+slot_claim(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	envid_t owner;
+	int i;
+
+	for (i = 1; i < THREAD_NSLOTS; i++) {
+		owner = slot_owner[i];
+		if (owner < 0 || (owner > 0
+				  && envs[ENVX(owner)].env_id == owner
+				  && envs[ENVX(owner)].env_status != ENV_FREE))
+			continue;
+		if (cmpxchg((volatile uint32_t *) &slot_owner[i], owner, -1) == owner)
+			return i;
+	}
+	return -E_NO_MEM;
+}
+
+// Where a thread made by sfork starts, on a stack that sfork built to
+// look as if sfork_start(entry, arg) had been called.
+static void
+sfork_start(void (*entry)(void *), void *arg)
+{
+	thisenv = &envs[ENVX(sys_getenvid())];
+	entry(arg);
+	sys_env_destroy(0);
+}
+
+//
+// Shared-memory fork: start a thread that shares all of our memory and
+// runs entry(arg) on a stack of its own, in a free thread slot.  The
+// len bytes at arg are copied to the top of the new stack first, and
+// entry gets the copy, so arg may point at the caller's local
+// variables; if len is 0, entry gets arg itself.  The thread ends with sys_env_destroy(0) when entry
+// returns; it must not call exit(), which closes the file descriptors
+// all the threads share.
+//
+// Returns: the child's envid, or < 0 on error.
+//	-E_INVAL if len does not fit in the new stack page.
+//
+envid_t
+sfork(void (*entry)(void *), const void *arg, size_t len)
+{
+	uintptr_t top, esp;
+	envid_t envid;
+	int slot, r;
+
+	static_assert(sizeof(struct ThreadLocal) <= PGSIZE);
+
+	if (len > PGSIZE / 2)
+		return -E_INVAL;
+	if ((slot = slot_claim()) < 0)
+		return slot;
+	top = UXSTACKTOP - slot * THREAD_SLOTSIZE;
+	batch_page_alloc(0, (void *) (top - THREAD_SLOTSIZE), PTE_P|PTE_U|PTE_W);
+	batch_page_alloc(0, (void *) (top - 3 * PGSIZE), PTE_P|PTE_U|PTE_W);
+	batch_page_alloc(0, (void *) (top - PGSIZE), PTE_P|PTE_U|PTE_W);
+	if ((r = batch_flush()) < 0) {
+		slot_owner[slot] = 0;
+		return r;
+	}
+
+	// The stack page ends at top - 2 * PGSIZE: the copy of arg, then
+	// sfork_start's arguments and a null return address.
+	esp = top - 2 * PGSIZE - ROUNDUP(len, 4);
+	memmove((void *) esp, arg, len);
+	esp -= 3 * sizeof(uint32_t);
+	((uint32_t *) esp)[0] = 0;
+	((uint32_t *) esp)[1] = (uint32_t) entry;
+	((uint32_t *) esp)[2] = len ? esp + 3 * sizeof(uint32_t)
+				    : (uint32_t) arg;
+
+	if ((envid = sys_sfork((uintptr_t) sfork_start, esp, top)) < 0) {
+		slot_owner[slot] = 0;
+		return envid;
+	}
+	slot_owner[slot] = envid;
+	return envid;
 }
@@ -43,12 +43,12 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 	return val;
 }
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks in the kernel until 'toenv' receives the value.
+// It should panic() on any error.
+// IPC_DONATE in 'perm' is passed through even if 'pg' is null.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
+//   If 'pg' is null, pass sys_ipc_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
@@ -56,18 +56,71 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	// LAB 4: Your code here.
 	int r;
 
+	if (!pg) {
+		pg = (void *) ( UTOP + 1 );
+		perm &= IPC_DONATE;
+	}
+
+	if ((r = sys_ipc_send(to_env, val, pg, perm)) < 0)
+		panic("ipc_send: error %e\n", r);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env'
+// and wait for its reply, which is received as by ipc_recv(NULL,
+// rcv_pg, perm_store).  Only 'to_env' can reply.
+// Returns the reply value, or < 0 if the call itself failed.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int32_t r;
+
 	if (!pg) {
 		pg = (void *) ( UTOP + 1 );
 		perm = 0;
 	}
+	if (!rcv_pg) rcv_pg = (void *) (UTOP + 1);
 
-	while (1) {
-		r = sys_ipc_try_send(to_env, val, pg, perm);
-		if (!r) break;
-		else if (r != -E_IPC_NOT_RECV) panic("ipc_send: error %e\n", r);
+	if ((r = sys_ipc_call(to_env, val, pg, perm, rcv_pg)) < 0) {
+		if (perm_store) *perm_store = 0;
+		return r;
 	}
-	sys_yield();
-	
+	if (perm_store) *perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Server side of ipc_call: if 'to_env' is nonzero, reply to it with
+// 'val' (and 'pg' with 'perm', if 'pg' is nonnull), then receive the
+// next request as ipc_recv(from_env_store, rcv_pg, perm_store) would.
+//
+// The kernel reply does not wait for 'to_env'.  If 'to_env' is not
+// blocked in ipc_call (a client doing ipc_send and then ipc_recv, say)
+// fall back to a blocking ipc_send; if it no longer exists, drop the
+// reply.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int32_t r;
+
+	if (!pg) {
+		pg = (void *) ( UTOP + 1 );
+		perm = 0;
+	}
+	if (!rcv_pg) rcv_pg = (void *) (UTOP + 1);
+
+	r = sys_ipc_reply_wait(to_env, val, pg, perm, rcv_pg);
+	if (r == -E_IPC_NOT_RECV || r == -E_BAD_ENV) {
+		if (r == -E_IPC_NOT_RECV)
+			ipc_send(to_env, val, pg, perm);
+		r = sys_ipc_reply_wait(0, 0, 0, 0, rcv_pg);
+	}
+	if (r < 0)
+		panic("ipc_reply_wait: error %e\n", r);
+
+	if (from_env_store) *from_env_store = thisenv->env_ipc_from;
+	if (perm_store) *perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
 }
 
 // Find the first environment of the given type.  We'll use this to
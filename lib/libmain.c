@@ -5,7 +5,8 @@
 
 extern void umain(int argc, char **argv);
 
-const volatile struct Env *thisenv;
+// The main thread's ThreadLocal; see inc/lib.h.
+struct ThreadLocal thread_main __attribute__((aligned(PGSIZE)));
 const char *binaryname = "<unknown>";
 
 void
@@ -13,6 +14,7 @@ libmain(int argc, char **argv)
 {
 	// set thisenv to point at our Env structure in envs[].
 	// LAB 3: Your code here.
+	syscall_use_sysenter = sysenter_supported();
 	thisenv = (struct Env* ) &envs[ENVX(sys_getenvid())];
 
 	// save the name of the program so that panic() can use it
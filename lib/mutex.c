@@ -0,0 +1,97 @@
+// Mutexes and condition variables for threads made by sfork.
+//
+// Both spin on nothing: an uncontended mutex costs one atomic
+// instruction, and a thread that has to wait sleeps in the kernel with
+// sys_futex_wait until another thread calls sys_futex_wake on the same
+// word.  This is the three-state mutex from Drepper's "Futexes Are
+// Tricky".
+
+#include <inc/lib.h>
+
+void
+mutex_init(struct Mutex *m)
+{
+	m->m_state = 0;
+}
+
+void
+mutex_lock(struct Mutex *m)
+{
+	uint32_t c;
+
+	if ((c = cmpxchg(&m->m_state, 0, 1)) == 0)
+		return;
+	// Mark the mutex contended, so that whoever holds it wakes us.
+	if (c != 2)
+		c = xchg(&m->m_state, 2);
+	while (c != 0) {
+		sys_futex_wait(&m->m_state, 2, 0);
+		c = xchg(&m->m_state, 2);
+	}
+}
+
+// Returns true if we got the mutex without waiting.
+bool
+mutex_trylock(struct Mutex *m)
+{
+	return cmpxchg(&m->m_state, 0, 1) == 0;
+}
+
+void
+mutex_unlock(struct Mutex *m)
+{
+	if (xchg(&m->m_state, 0) == 2)
+		sys_futex_wake(&m->m_state, 1);
+}
+
+void
+cond_init(struct Cond *c)
+{
+	c->c_seq = 0;
+}
+
+// Release m, wait for c to be signaled for at most usec microseconds
+// (or for good if usec is 0), and take m again.  Like all condition
+// variables, this can return early, so callers should recheck.
+// Returns 0, or -E_TIMEOUT if the time ran out.
+int
+cond_timedwait(struct Cond *c, struct Mutex *m, unsigned int usec)
+{
+	uint32_t seq = c->c_seq;
+	int r;
+
+	mutex_unlock(m);
+	r = sys_futex_wait(&c->c_seq, seq, usec);
+	mutex_lock(m);
+	return r == -E_TIMEOUT ? r : 0;
+}
+
+void
+cond_wait(struct Cond *c, struct Mutex *m)
+{
+	cond_timedwait(c, m, 0);
+}
+
+static void
+cond_bump(struct Cond *c)
+{
+	uint32_t seq;
+
+	do {
+		seq = c->c_seq;
+	} while (cmpxchg(&c->c_seq, seq, seq + 1) != seq);
+}
+
+void
+cond_signal(struct Cond *c)
+{
+	cond_bump(c);
+	sys_futex_wake(&c->c_seq, 1);
+}
+
+void
+cond_broadcast(struct Cond *c)
+{
+	cond_bump(c);
+	sys_futex_wake(&c->c_seq, NENV);
+}
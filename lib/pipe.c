@@ -19,12 +19,30 @@ struct Dev devpipe =
 
 #define PIPEBUFSIZ 32		// small to provoke races
 
+// Ends of a pipe, as indexes into p_fdpage and p_closed
+#define PIPE_READ	0
+#define PIPE_WRITE	1
+
+// Waiters sleep on p_seq, which moves whenever they should look again:
+// when the other end moves its position while they wait, and when the
+// last Fd of the other end is closed.
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	uint32_t p_seq;		// futex word waiters sleep on
+	uint32_t p_rwaiting;	// a reader may be waiting for p_wpos to move
+	uint32_t p_wwaiting;	// a writer may be waiting for p_rpos to move
+	uint32_t p_fdpage[2];	// page number of each end's Fd page
+	uint32_t p_closed[2];	// each end's last Fd has been closed
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
+static int
+pipe_end(struct Fd *fd)
+{
+	return (fd->fd_omode & O_ACCMODE) == O_WRONLY ? PIPE_WRITE : PIPE_READ;
+}
+
 int
 pipe(int pfd[2])
 {
@@ -47,6 +65,8 @@ pipe(int pfd[2])
 		goto err2;
 	if ((r = sys_page_map(0, va, 0, fd2data(fd1), PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
 		goto err3;
+	((struct Pipe *) va)->p_fdpage[PIPE_READ] = PGNUM(uvpt[PGNUM(fd0)]);
+	((struct Pipe *) va)->p_fdpage[PIPE_WRITE] = PGNUM(uvpt[PGNUM(fd1)]);
 
 	// set up fd structures
 	fd0->fd_dev_id = devpipe.dev_id;
@@ -77,6 +97,8 @@ _pipeisclosed(struct Fd *fd, struct Pipe *p)
 {
 	int n, nn, ret;
 
+	if (p->p_closed[!pipe_end(fd)])
+		return 1;
 	while (1) {
 		n = thisenv->env_runs;
 		ret = pageref(fd) == pageref(p);
@@ -101,6 +123,37 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Wake everyone sleeping in pipe_wait.
+static void
+pipe_kick(struct Pipe *p)
+{
+	xadd(&p->p_seq, 1);
+	sys_futex_wake(&p->p_seq, NENV);
+}
+
+// Sleep until *pos is no longer val or the other end of fd is closed,
+// having set *waiting to ask the other end for a wakeup.  p_seq is read
+// before either is checked, so a wakeup after that cannot be missed.
+static void
+pipe_wait(struct Fd *fd, struct Pipe *p, uint32_t *waiting,
+	  off_t *pos, off_t val)
+{
+	uint32_t seq;
+
+	xchg(waiting, 1);
+	seq = *(volatile uint32_t *) &p->p_seq;
+	if (*(volatile off_t *) pos == val && !_pipeisclosed(fd, p))
+		sys_futex_wait(&p->p_seq, seq, 0);
+}
+
+// Wake the other end if it waits for our position to move.
+static void
+pipe_wake(struct Pipe *p, uint32_t *waiting)
+{
+	if (xchg(waiting, 0))
+		pipe_kick(p);
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
@@ -119,20 +172,22 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
-				return i;
+				goto out;
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer moves wpos
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read wait\n");
+			pipe_wait(fd, p, &p->p_rwaiting, &p->p_wpos, p->p_rpos);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+out:
+	pipe_wake(p, &p->p_wwaiting);
 	return i;
 }
 
@@ -157,10 +212,13 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let readers at what we wrote so far, and sleep
+			// until one of them moves rpos
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write wait\n");
+			pipe_wake(p, &p->p_rwaiting);
+			pipe_wait(fd, p, &p->p_wwaiting, &p->p_rpos,
+				  p->p_wpos - PIPEBUFSIZ);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -168,6 +226,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wake(p, &p->p_rwaiting);
 	return i;
 }
 
@@ -182,10 +241,22 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 	return 0;
 }
 
+// The other end only sees the pipe closed by page counts once the data
+// page is unmapped too, and then we can no longer wake it.  So if this
+// was the last Fd of its end anywhere, which leaves its page free, say
+// so in p_closed and wake the other end while the data page is still
+// mapped.
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+	int end = pipe_end(fd);
+
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	if (pages[p->p_fdpage[end]].pp_ref == 0) {
+		p->p_closed[end] = 1;
+		pipe_kick(p);
+	}
+	return sys_page_unmap(0, p);
 }
 
@@ -0,0 +1,19 @@
+// Sorting, for programs that report percentiles.
+
+#include <inc/lib.h>
+
+// Sort v[0..n) into ascending order.  Insertion sort: the arrays
+// measured here are small.
+void
+sort(uint32_t *v, int n)
+{
+	int i, j;
+	uint32_t x;
+
+	for (i = 1; i < n; i++) {
+		x = v[i];
+		for (j = i; j > 0 && v[j - 1] > x; j--)
+			v[j] = v[j - 1];
+		v[j] = x;
+	}
+}
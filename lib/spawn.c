@@ -275,25 +275,27 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
+	// Page operations are batched: blank pages cost nothing until
+	// the final flush, and each file page costs one SYS_batch, which
+	// also carries the previous page's map and unmap.
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
 			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
+			batch_page_alloc(child, (void*) (va + i), perm);
 		} else {
 			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			batch_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W);
+			if ((r = batch_flush()) < 0)
 				return r;
 			if ((r = seek(fd, fileoffset + i)) < 0)
 				return r;
 			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
 				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+			batch_page_map(0, UTEMP, child, (void*) (va + i), perm);
+			batch_page_unmap(0, UTEMP);
 		}
 	}
-	return 0;
+	return batch_flush();
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -305,14 +307,20 @@ copy_shared_pages(envid_t child)
 	for ( ; pn < PGNUM(UTOP); pn++){
 		void *va = (void *)(pn << PGSHIFT);
 		if (!(uvpd[PDX(va)] & PTE_P)) continue;
+		if (uvpd[PDX(va)] & PTE_PS) {
+			if (uvpd[PDX(va)] & PTE_SHARE)
+				batch_page_map(0, va, child, va, uvpd[PDX(va)] & PTE_SYSCALL);
+			pn += NPTENTRIES - 1;
+			continue;
+		}
 		if (!(uvpt[pn] & PTE_P)) continue;
 		if ((uint32_t)va < UXSTACKTOP - PGSIZE){			
-			if ( uvpt[pn] & PTE_SHARE ) {
-				if (sys_page_map(0, va, child, va, PGOFF(va) | PTE_SYSCALL) < 0)
-				panic("error in csp(), sys_page_map");
-			}
+			if ( uvpt[pn] & PTE_SHARE )
+				batch_page_map(0, va, child, va, PGOFF(va) | PTE_SYSCALL);
 		}
 	}
+	if ((r = batch_flush()) < 0)
+		panic("error in csp(), sys_page_map: %e", r);
 	return 0;
 }
 
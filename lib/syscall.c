@@ -2,6 +2,11 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+// Enter the kernel with sysenter rather than int $T_SYSCALL?
+// libmain turns this on when the CPU supports it.
+bool syscall_use_sysenter;
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -19,17 +24,38 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// The last clause tells the assembler that this can
 	// potentially change the condition codes and arbitrary
 	// memory locations.
+	//
+	// The sysenter path is cheaper, but sysenter loses %esp and
+	// %eip, so we pass the return address in SI and the stack
+	// pointer in BP, and sysexit returns with them in DX and CX.
+	// With SI spoken for, only calls that have no fifth parameter
+	// can take it.
 
-	asm volatile("int %1\n"
-		: "=a" (ret)
-		: "i" (T_SYSCALL),
-		  "a" (num),
-		  "d" (a1),
-		  "c" (a2),
-		  "b" (a3),
-		  "D" (a4),
-		  "S" (a5)
-		: "cc", "memory");
+	if (syscall_use_sysenter && a5 == 0) {
+		asm volatile("pushl %%ebp\n\t"
+			     "movl %%esp, %%ebp\n\t"
+			     "leal 1f, %%esi\n\t"
+			     "sysenter\n"
+			     "1:\tpopl %%ebp\n"
+			: "=a" (ret),
+			  "+d" (a1),
+			  "+c" (a2)
+			: "a" (num),
+			  "b" (a3),
+			  "D" (a4)
+			: "esi", "cc", "memory");
+	} else {
+		asm volatile("int %1\n"
+			: "=a" (ret)
+			: "i" (T_SYSCALL),
+			  "a" (num),
+			  "d" (a1),
+			  "c" (a2),
+			  "b" (a3),
+			  "D" (a4),
+			  "S" (a5)
+			: "cc", "memory");
+	}
 
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -85,6 +111,12 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_page_alloc_large, 1, envid, (uint32_t) va, perm, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
 int
@@ -105,6 +137,12 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 	return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint32_t) upcall, 0, 0, 0);
 }
 
+int
+sys_env_set_priority(envid_t envid, int priority)
+{
+	return syscall(SYS_env_set_priority, 1, envid, priority, 0, 0, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
@@ -117,12 +155,42 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
 unsigned int
 sys_time_msec(void)
 {
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
+unsigned int
+sys_time_usec(void)
+{
+	return (unsigned int) syscall(SYS_time_usec, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_sleep_usec(unsigned int usec)
+{
+	return syscall(SYS_sleep_usec, 0, usec, 0, 0, 0, 0);
+}
+
 int 
 sys_net_output(const char* va, int len) {
 	return syscall(SYS_net_output, 1, (uint32_t) va, len, 0, 0, 0); 
@@ -131,3 +199,87 @@ sys_net_output(const char* va, int len) {
 int sys_net_input(char* va, int* len) {
 	return syscall(SYS_net_input, 1, (uint32_t) va, (uint32_t) len, 0, 0, 0);
 }
+
+// Receive a packet, sleeping until one comes in.  The kernel wakes us
+// with -E_NO_FREE when one does, so go back for it.
+int
+sys_net_recv(char *va, int *len)
+{
+	int r;
+
+	while ((r = syscall(SYS_net_recv, 0, (uint32_t) va, (uint32_t) len, 0, 0, 0)) == -E_NO_FREE)
+		;
+	return r;
+}
+
+// Like sys_net_recv, but map the packet's page at va instead of copying
+// it.  Returns the frame's length.
+int
+sys_net_recv_page(void *va)
+{
+	int r;
+
+	while ((r = syscall(SYS_net_recv_page, 0, (uint32_t) va, 0, 0, 0, 0)) == -E_NO_FREE)
+		;
+	return r;
+}
+
+int
+sys_net_send_batch(const struct NetFrag *frags, int nfrags, struct NetTxSeq *seq)
+{
+	return syscall(SYS_net_send_batch, 0, (uint32_t) frags, nfrags, (uint32_t) seq, 0, 0);
+}
+
+// Like sys_net_recv, but for a whole batch of frames; see the kernel.
+int
+sys_net_recv_batch(struct NetBatch *b, int maxcopy)
+{
+	int r;
+
+	while ((r = syscall(SYS_net_recv_batch, 0, (uint32_t) b, maxcopy, 0, 0, 0)) == -E_NO_FREE)
+		;
+	return r;
+}
+
+int
+sys_net_map(void *va)
+{
+	return syscall(SYS_net_map, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+// With wait set, returns -E_NO_FREE after sleeping for a frame.
+int
+sys_net_sync(int wait)
+{
+	return syscall(SYS_net_sync, 0, wait, 0, 0, 0, 0);
+}
+
+int
+sys_batch(struct BatchRing *ring)
+{
+	return syscall(SYS_batch, 0, (uint32_t) ring, 0, 0, 0, 0);
+}
+
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+envid_t
+sys_sfork(uintptr_t eip, uintptr_t esp, uintptr_t xstacktop)
+{
+	return syscall(SYS_sfork, 0, eip, esp, xstacktop, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned int usec)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, val, usec, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
@@ -2,6 +2,13 @@
 
 extern union Nsipc nsipcbuf;
 
+// Frames up to this long are copied in batches rather than mapped
+#define INPUT_COPY_MAX	256
+
+// Where received pages are mapped; nsipcbuf holds batches.
+static char pktbuf[PGSIZE] __attribute__((aligned(PGSIZE)));
+static struct jif_pkt *pkt = (struct jif_pkt *) pktbuf;
+
 void
 input(envid_t ns_envid)
 {
@@ -15,20 +22,39 @@ input(envid_t ns_envid)
 	// another packet in to the same physical page.
 	char buf[2048];
 	int perm = PTE_U | PTE_P | PTE_W;
-	int len = 2047;
+	bool fresh = 0;		// Whether nsipcbuf is a page of our own
+	int len, ret;
 
 	while(1) {
-
-		int ret;
-		while((ret = sys_net_input(buf, &len)) < 0) sys_yield();
-
-		//previous page is automatically "page remove"ed
-		while ((ret = sys_page_alloc(0, &nsipcbuf, perm)) < 0);
-
-		nsipcbuf.pkt.jp_len = len;
-		memmove(nsipcbuf.pkt.jp_data, buf, len);
-
-		while ((ret = sys_ipc_try_send(ns_envid, NSREQ_INPUT, &nsipcbuf, perm)) < 0);
-	} 
-		
+		// Small frames (ACKs, ARP) are cheaper to copy, many to a
+		// page, than to send in pages of their own.  A page that
+		// was sent is the network server's now, so replace it.
+		if (!fresh)
+			while ((ret = sys_page_alloc(0, &nsipcbuf, perm)) < 0);
+		fresh = 1;
+		if ((ret = sys_net_recv_batch(&nsipcbuf.batch, INPUT_COPY_MAX)) < 0)
+			panic("sys_net_recv_batch: %e", ret);
+		if (ret > 0) {
+			ipc_send(ns_envid, NSREQ_INPUT_BATCH, &nsipcbuf,
+				 perm | IPC_DONATE);
+			fresh = 0;
+			continue;
+		}
+
+		// The NIC's page replaces the one we sent last time.  The
+		// frame is already where a jif_pkt keeps its data.
+		if ((len = sys_net_recv_page(pkt)) == -E_NO_MEM) {
+			// Too many received pages are still in use; copy.
+			if ((ret = sys_net_recv(buf, &len)) < 0)
+				panic("sys_net_recv: %e", ret);
+			while ((ret = sys_page_alloc(0, pkt, perm)) < 0);
+			memmove(pkt->jp_data, buf, len);
+		} else if (len < 0)
+			panic("sys_net_recv_page: %e", len);
+		pkt->jp_len = len;
+
+		// Let the network server run the packet through lwIP
+		// right away rather than waiting for its turn.
+		ipc_send(ns_envid, NSREQ_INPUT, pkt, perm | IPC_DONATE);
+	}
 }
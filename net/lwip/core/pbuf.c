@@ -497,6 +497,10 @@ pbuf_free(struct pbuf *p)
       type = p->type;
       /* is this a pbuf from the pool? */
       if (type == PBUF_POOL) {
+#ifdef PBUF_POOL_FREE_HOOK
+        /* the port may have built this pbuf in memory of its own */
+        if (!PBUF_POOL_FREE_HOOK(p))
+#endif
         memp_free(MEMP_PBUF_POOL, p);
       /* is this a ROM or RAM referencing pbuf? */
       } else if (type == PBUF_ROM || type == PBUF_REF) {
@@ -6,6 +6,7 @@
 #include <arch/sys_arch.h>
 #include <arch/perror.h>
 #include <arch/queue.h>
+#include <jif/jif.h>
 
 #define debug 0
 
@@ -13,16 +14,17 @@
 #define NMBOX		128
 #define MBOXSLOTS	32
 
+// The core lock serializes all of lwIP, as the green threads used to;
+// a thread lets go of it only while it sleeps in sys_arch_sem_wait or
+// outside lwIP.  Semaphores, mailboxes and timeouts are protected by it.
+static struct Mutex lwip_core;
+
 struct sys_sem_entry {
     int freed;
     int gen;
-    union {
-	uint32_t v;
-	struct {
-	    uint16_t counter;
-	    uint16_t waiters;
-	};
-    };
+    uint16_t counter;
+    uint16_t waiters;
+    struct Cond cond;
     LIST_ENTRY(sys_sem_entry) link;
 };
 static struct sys_sem_entry sems[NSEM];
@@ -142,6 +144,7 @@ sys_sem_new(u8_t count)
     se->freed = 0;
 
     se->counter = count;
+    se->waiters = 0;
     se->gen++;
     return se - &sems[0];
 }
@@ -160,10 +163,8 @@ sys_sem_signal(sys_sem_t sem)
 {
     assert(!sems[sem].freed);
     sems[sem].counter++;
-    if (sems[sem].waiters) {
-	sems[sem].waiters = 0;
-	thread_wakeup(&sems[sem].v);
-    }
+    if (sems[sem].waiters)
+	cond_signal(&sems[sem].cond);
 }
 
 u32_t
@@ -182,16 +183,15 @@ sys_arch_sem_wait(sys_sem_t sem, u32_t tm_msec)
 	    return SYS_ARCH_TIMEOUT;
 	} else {
 	    uint32_t a = sys_time_msec();
-	    uint32_t sleep_until = tm_msec ? a + (tm_msec - waited) : ~0;
-	    sems[sem].waiters = 1;
-	    uint32_t cur_v = sems[sem].v;
-	    lwip_core_unlock();
-	    thread_wait(&sems[sem].v, cur_v, sleep_until);
-	    lwip_core_lock();
+	    sems[sem].waiters++;
+	    jif_flush();
+	    cond_timedwait(&sems[sem].cond, &lwip_core,
+			   tm_msec ? (tm_msec - waited) * 1000 : 0);
 	    if (gen != sems[sem].gen) {
 		cprintf("sys_arch_sem_wait: sem freed under waiter!\n");
 		return SYS_ARCH_TIMEOUT;
 	    }
+	    sems[sem].waiters--;
 	    uint32_t b = sys_time_msec();
 	    waited += (b - a);
 	}
@@ -240,8 +240,8 @@ lwip_thread_entry(uint32_t arg)
     struct lwip_thread *lt = (struct lwip_thread *)arg;
     lwip_core_lock();
     lt->func(lt->arg);
-    lwip_core_unlock();
     free(lt);
+    lwip_core_unlock();
 }
 
 sys_thread_t
@@ -314,9 +314,13 @@ out:
 void
 lwip_core_lock(void)
 {
+    mutex_lock(&lwip_core);
 }
 
+// Frames lwIP sent while holding the lock go out as one batch now.
 void
 lwip_core_unlock(void)
 {
+    jif_flush();
+    mutex_unlock(&lwip_core);
 }
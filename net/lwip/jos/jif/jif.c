@@ -46,6 +46,12 @@
 
 #define PKTMAP		0x10000000
 
+/* Marks a pbuf built by jif_input_page() in a received page. */
+#define PBUF_FLAG_JIF_PAGE	0x80U
+
+/* Gives back a received page once lwIP is done with it. */
+static void (*page_release)(void *va);
+
 struct jif {
     struct eth_addr *ethaddr;
     envid_t envid;
@@ -69,26 +75,115 @@ low_level_init(struct netif *netif)
     netif->hwaddr[5] = 0x56;
 }
 
+/* Frames handed to the NIC without copying, oldest first, each held
+ * with a reference until the NIC is done with it (see struct NetTxSeq). */
+#define TX_INFLIGHT	64
+
+static struct {
+    u32_t seq;
+    struct pbuf *p;
+} tx_inflight[TX_INFLIGHT];
+static u32_t tx_head, tx_tail;
+
+/* Frames waiting for jif_flush(), each also holding a reference. */
+static struct NetFrag tx_frags[NET_BATCH_MAXFRAGS];
+static struct pbuf *tx_pending[NET_BATCH_MAX];
+static int tx_nfrags, tx_npending;
+
+/* The NIC's rings, if jif_netmap() mapped them (see struct NetMap).
+ * lwIP then copies frames in and out of the ring slots itself, and
+ * nm_dirty notes slots that the kernel has yet to hear about. */
+static struct NetMap *nm;
+static struct NetTxDesc *nm_txring;
+static struct NetRxDesc *nm_rxring;
+static int nm_dirty;
+
+static void
+tx_reap(u32_t done)
+{
+    while (tx_head != tx_tail &&
+	   (s32_t)(done - tx_inflight[tx_head % TX_INFLIGHT].seq) > 0) {
+	pbuf_free(tx_inflight[tx_head % TX_INFLIGHT].p);
+	tx_head++;
+    }
+}
+
 /*
- * low_level_output():
+ * jif_flush():
  *
- * Should do the actual transmission of the packet. The packet is
- * contained in the pbuf that is passed to the function. This pbuf
- * might be chained.
+ * Hands the frames batched up by low_level_output() to the NIC, with
+ * as few system calls as the transmit ring allows. Called whenever the
+ * lwIP core lock is about to be released, so a frame waits at most
+ * until lwIP is done with whatever produced it.
+ *
+ */
+void
+jif_flush(void)
+{
+    struct NetTxSeq seq;
+    int nframes, nfrags, i, r;
+
+    if (nm != NULL) {
+	if (nm_dirty || nm->nm_tx_head != nm->nm_tx_cur) {
+	    sys_net_sync(0);
+	    nm_dirty = 0;
+	}
+	return;
+    }
+
+    while (tx_npending > 0) {
+	/* make room to remember the frames */
+	while (tx_tail - tx_head + tx_npending > TX_INFLIGHT) {
+	    sys_net_send_batch(0, 0, &seq);
+	    tx_reap(seq.ts_done);
+	    if (tx_tail - tx_head + tx_npending > TX_INFLIGHT)
+		sys_yield();
+	}
+
+	if ((r = sys_net_send_batch(tx_frags, tx_nfrags, &seq)) < 0)
+	    panic("jif: sys_net_send_batch: %e", r);
+	nframes = r;
+
+	for (i = 0, nfrags = 0; i < nframes; nfrags++)
+	    if (tx_frags[nfrags].nf_flags & NET_FRAG_EOP) {
+		tx_inflight[tx_tail % TX_INFLIGHT].seq = seq.ts_sent + i;
+		tx_inflight[tx_tail % TX_INFLIGHT].p = tx_pending[i];
+		tx_tail++;
+		i++;
+	    }
+	memmove(tx_frags, tx_frags + nfrags,
+		(tx_nfrags - nfrags) * sizeof(tx_frags[0]));
+	memmove(tx_pending, tx_pending + nframes,
+		(tx_npending - nframes) * sizeof(tx_pending[0]));
+	tx_nfrags -= nfrags;
+	tx_npending -= nframes;
+
+	tx_reap(seq.ts_done);
+	if (nframes == 0)	/* the ring is full */
+	    sys_yield();
+    }
+}
+
+/*
+ * low_level_output_copy():
+ *
+ * Flattens the pbuf chain into a page and sends it to the output
+ * environment. Used for frames in too many pieces for
+ * sys_net_send_batch().
  *
  */
 static err_t
-low_level_output(struct netif *netif, struct pbuf *p)
+low_level_output_copy(struct netif *netif, struct pbuf *p)
 {
     int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
     if (r < 0)
 	panic("jif: could not allocate page of memory");
-    struct jif_pkt *pkt = (struct jif_pkt *)PKTMAP;
+    struct NetBatch *b = (struct NetBatch *)PKTMAP;
 
     struct jif *jif;
     jif = netif->state;
 
-    char *txbuf = pkt->jp_data;
+    char *txbuf = (char *)(b + 1);
     int txsize = 0;
     struct pbuf *q;
     for (q = p; q != NULL; q = q->next) {
@@ -102,10 +197,102 @@ low_level_output(struct netif *netif, struct pbuf *p)
 	txsize += q->len;
     }
 
-    pkt->jp_len = txsize;
+    b->nb_count = 1;
+    b->nb_frames[0].nbf_off = sizeof(*b);
+    b->nb_frames[0].nbf_len = txsize;
+
+    /* keep the frames in order */
+    jif_flush();
+    ipc_send(jif->envid, NSREQ_OUTPUT, (void *)b, PTE_P|PTE_W|PTE_U);
+    sys_page_unmap(0, (void *)b);
+
+    return ERR_OK;
+}
+
+/*
+ * low_level_output_netmap():
+ *
+ * Copies the frame into the next transmit slot of the mapped rings,
+ * waiting for the NIC to be done with the slot first. jif_flush()
+ * tells the kernel about it.
+ *
+ */
+static err_t
+low_level_output_netmap(struct netif *netif, struct pbuf *p)
+{
+    u32_t slot = nm->nm_tx_head;
+
+    if (p->tot_len > nm->nm_txbuf_size)
+	return ERR_BUF;
+
+    while ((slot + 1) % nm->nm_ntx == nm->nm_tx_cur ||
+	   !(nm_txring[slot].td_status & NET_TXD_DD)) {
+	jif_flush();
+	if ((slot + 1) % nm->nm_ntx == nm->nm_tx_cur ||
+	    !(nm_txring[slot].td_status & NET_TXD_DD))
+	    sys_yield();
+    }
+
+    pbuf_copy_partial(p, (char *)nm + nm->nm_txbuf +
+		      slot * nm->nm_txbuf_size, p->tot_len, 0);
+    nm->nm_tx_len[slot] = p->tot_len;
+    nm->nm_tx_head = (slot + 1) % nm->nm_ntx;
+    return ERR_OK;
+}
+
+/*
+ * low_level_output():
+ *
+ * Should do the actual transmission of the packet. The packet is
+ * contained in the pbuf that is passed to the function. This pbuf
+ * might be chained.
+ *
+ * The NIC reads the pbufs where they are, so p is kept until it is
+ * done with them. The frame is only batched up here; jif_flush()
+ * sends it.
+ *
+ */
+static err_t
+low_level_output(struct netif *netif, struct pbuf *p)
+{
+    struct NetFrag frags[NET_MAXFRAGS];
+    struct pbuf *q;
+    int nfrags = 0;
 
-    ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
-    sys_page_unmap(0, (void *)pkt);
+    if (nm != NULL)
+	return low_level_output_netmap(netif, p);
+
+    for (q = p; q != NULL; q = q->next) {
+	char *va = q->payload;
+	u16_t len = q->len;
+
+	/* one fragment per page the pbuf touches */
+	while (len > 0) {
+	    u16_t off = PGOFF(va);
+	    u16_t n = LWIP_MIN(len, PGSIZE - off);
+
+	    if (nfrags == NET_MAXFRAGS)
+		return low_level_output_copy(netif, p);
+	    frags[nfrags].nf_page = ROUNDDOWN(va, PGSIZE);
+	    frags[nfrags].nf_off = off;
+	    frags[nfrags].nf_len = n;
+	    frags[nfrags].nf_flags = 0;
+	    nfrags++;
+	    va += n;
+	    len -= n;
+	}
+    }
+    if (nfrags == 0)
+	return ERR_OK;
+    frags[nfrags - 1].nf_flags = NET_FRAG_EOP;
+
+    if (tx_npending == NET_BATCH_MAX ||
+	tx_nfrags + nfrags > NET_BATCH_MAXFRAGS)
+	jif_flush();
+    memcpy(tx_frags + tx_nfrags, frags, nfrags * sizeof(frags[0]));
+    tx_nfrags += nfrags;
+    pbuf_ref(p);
+    tx_pending[tx_npending++] = p;
 
     return ERR_OK;
 }
@@ -118,18 +305,14 @@ low_level_output(struct netif *netif, struct pbuf *p)
  *
  */
 static struct pbuf *
-low_level_input(void *va)
+low_level_input(const void *rxbuf, s16_t len)
 {
-    struct jif_pkt *pkt = (struct jif_pkt *)va;
-    s16_t len = pkt->jp_len;
-
     struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
     if (p == 0)
 	return 0;
 
     /* We iterate over the pbuf chain until we have read the entire
      * packet into the pbuf. */
-    void *rxbuf = (void *) pkt->jp_data;
     int copied = 0;
     struct pbuf *q;
     for (q = p; q != NULL; q = q->next) {
@@ -139,12 +322,58 @@ low_level_input(void *va)
 	int bytes = q->len;
 	if (bytes > (len - copied))
 	    bytes = len - copied;
-	memcpy(q->payload, rxbuf + copied, bytes);
+	memcpy(q->payload, (const char *)rxbuf + copied, bytes);
 	copied += bytes;
     }
 
     return p;
 }
+
+/*
+ * low_level_input_page():
+ *
+ * Turns the received page at va into a pbuf without copying the
+ * packet: the pbuf header goes in the free space at the start of the
+ * page, in front of the frame, where pbuf_header() can also grow the
+ * payload to build a reply in place.
+ *
+ */
+static struct pbuf *
+low_level_input_page(void *va)
+{
+    struct jif_pkt *pkt = (struct jif_pkt *)va;
+    struct pbuf *p = (struct pbuf *)va;
+    u16_t len = pkt->jp_len;
+
+    static_assert(LWIP_MEM_ALIGN_SIZE(sizeof(struct pbuf)) <=
+		  offsetof(struct jif_pkt, jp_data));
+
+    p->next = NULL;
+    p->payload = pkt->jp_data;
+    p->tot_len = p->len = len;
+    p->type = PBUF_POOL;
+    p->flags = PBUF_FLAG_JIF_PAGE;
+    p->ref = 1;
+    return p;
+}
+
+/*
+ * jif_free_pbuf():
+ *
+ * Called by pbuf_free() for every PBUF_POOL pbuf. Returns 1 if the pbuf
+ * was built by low_level_input_page(), after releasing its page, and
+ * 0 if it belongs to the pool.
+ *
+ */
+int
+jif_free_pbuf(struct pbuf *p)
+{
+    if (!(p->flags & PBUF_FLAG_JIF_PAGE))
+	return 0;
+    page_release(p);
+    return 1;
+}
+
 /*
  * jif_output():
  *
@@ -163,29 +392,19 @@ jif_output(struct netif *netif, struct pbuf *p,
 }
 
 /*
- * jif_input():
+ * jif_input_pbuf():
  *
- * This function should be called when a packet is ready to be read
- * from the interface. It uses the function low_level_input() that
- * should handle the actual reception of bytes from the network
- * interface.
+ * Passes a received Ethernet frame to ARP or IP, which take over p.
  *
  */
 
-void
-jif_input(struct netif *netif, void *va)
+static void
+jif_input_pbuf(struct netif *netif, struct pbuf *p)
 {
     struct jif *jif;
     struct eth_hdr *ethhdr;
-    struct pbuf *p;
 
     jif = netif->state;
-  
-    /* move received packet into a new pbuf */
-    p = low_level_input(va);
-
-    /* no packet could be read, silently ignore this */
-    if (p == NULL) return;
     /* points to packet payload, which starts with an Ethernet header */
     ethhdr = p->payload;
 
@@ -209,6 +428,124 @@ jif_input(struct netif *netif, void *va)
     }
 }
 
+/*
+ * jif_input():
+ *
+ * This function should be called when a packet is ready to be read
+ * from the interface. It uses the function low_level_input() that
+ * should handle the actual reception of bytes from the network
+ * interface.
+ *
+ */
+
+void
+jif_input(struct netif *netif, void *va)
+{
+    struct jif_pkt *pkt = (struct jif_pkt *)va;
+    struct pbuf *p;
+
+    /* move received packet into a new pbuf */
+    p = low_level_input(pkt->jp_data, pkt->jp_len);
+
+    /* no packet could be read, silently ignore this */
+    if (p == NULL) return;
+    jif_input_pbuf(netif, p);
+}
+
+/*
+ * jif_input_batch():
+ *
+ * Like jif_input(), for each of the packets in the struct NetBatch at
+ * va.
+ *
+ */
+
+void
+jif_input_batch(struct netif *netif, void *va)
+{
+    struct NetBatch *b = (struct NetBatch *)va;
+    struct pbuf *p;
+    u32_t i;
+
+    for (i = 0; i < b->nb_count && i < NET_BATCH_MAX; i++) {
+	if (b->nb_frames[i].nbf_off + b->nb_frames[i].nbf_len > PGSIZE)
+	    break;
+	p = low_level_input((char *)va + b->nb_frames[i].nbf_off,
+			    b->nb_frames[i].nbf_len);
+	if (p != NULL)
+	    jif_input_pbuf(netif, p);
+    }
+}
+
+/*
+ * jif_input_page():
+ *
+ * Like jif_input(), but lwIP takes over the page at va, holding the
+ * struct jif_pkt, instead of a copy of the packet. release(va) is
+ * called when lwIP is done with it, which may be before this returns.
+ *
+ */
+
+void
+jif_input_page(struct netif *netif, void *va, void (*release)(void *va))
+{
+    page_release = release;
+    jif_input_pbuf(netif, low_level_input_page(va));
+}
+
+/*
+ * jif_netmap():
+ *
+ * Maps the NIC's rings at va, for lwIP to send and receive through
+ * directly, without the input and output environments. Must be called
+ * before jif_init(); returns < 0 if the rings could not be mapped, in
+ * which case nothing changes.
+ *
+ */
+
+int
+jif_netmap(void *va)
+{
+    int r;
+
+    if ((r = sys_net_map(va)) < 0)
+	return r;
+    nm = (struct NetMap *)va;
+    nm_txring = (struct NetTxDesc *)((char *)va + nm->nm_txring);
+    nm_rxring = (struct NetRxDesc *)((char *)va + nm->nm_rxring);
+    return 0;
+}
+
+/*
+ * jif_netmap_input():
+ *
+ * Passes up to NET_BATCH_MAX frames from the mapped receive ring to
+ * lwIP, copying each so that its slot can go straight back to the NIC
+ * at the next jif_flush(). Returns the number of frames.
+ *
+ */
+
+int
+jif_netmap_input(struct netif *netif)
+{
+    u32_t slot = nm->nm_rx_head;
+    struct pbuf *p;
+    int n;
+
+    for (n = 0; n < NET_BATCH_MAX &&
+		(nm_rxring[slot].rd_status & NET_RXD_DD); n++) {
+	p = low_level_input((char *)nm + nm->nm_rxbuf + slot * PGSIZE +
+			    NET_RXPAGE_DATA, nm_rxring[slot].rd_len);
+	slot = (slot + 1) % nm->nm_nrx;
+	nm->nm_rx_head = slot;
+	if (p != NULL)
+	    jif_input_pbuf(netif, p);
+    }
+    if (n > 0)
+	nm_dirty = 1;
+    return n;
+}
+
 /*
  * jif_init():
  *
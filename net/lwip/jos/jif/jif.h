@@ -1,4 +1,10 @@
 #include <lwip/netif.h>
 
 void	jif_input(struct netif *netif, void *va);
+void	jif_input_batch(struct netif *netif, void *va);
+void	jif_input_page(struct netif *netif, void *va,
+		       void (*release)(void *va));
 err_t	jif_init(struct netif *netif);
+int	jif_netmap(void *va);
+int	jif_netmap_input(struct netif *netif);
+void	jif_flush(void);
@@ -37,6 +37,12 @@ void *memcpy(void *dst, const void *src, size_t n);
 #define PBUF_POOL_SIZE		512
 #define PBUF_POOL_BUFSIZE	2000
 
+// jif builds PBUF_POOL pbufs inside received pages (see
+// jif_input_page); pbuf_free hands those back to it instead of memp.
+struct pbuf;
+int jif_free_pbuf(struct pbuf *p);
+#define PBUF_POOL_FREE_HOOK(p)	jif_free_pbuf(p)
+
 #define TCP_MSS			1460
 #define TCP_WND			24000
 #define TCP_SND_BUF		(16 * TCP_MSS)
@@ -8,9 +8,12 @@
 #define TIMER_INTERVAL 250
 
 // Virtual address at which to receive page mappings containing client requests.
-#define QUEUE_SIZE	20
+#define QUEUE_SIZE	64
 #define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
 
+// Virtual address at which the NIC's rings are mapped, if they are.
+#define NETMAP		0x20000000
+
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
 
@@ -11,9 +11,30 @@ output(envid_t ns_envid)
 	// LAB 6: Your code here:
 	// 	- read a packet from the network server
 	//	- send the packet to the device driver
+	struct NetFrag frags[NET_BATCH_MAX];
+	struct NetTxSeq seq;
+	struct NetBatch *b = &nsipcbuf.batch;
+	int i, n;
+
 	while(1) {
 		ret = sys_ipc_recv(&nsipcbuf);
 		if ((thisenv->env_ipc_from != ns_envid) || (thisenv->env_ipc_value != NSREQ_OUTPUT)) continue;
-		while((ret = sys_net_output(nsipcbuf.pkt.jp_data, nsipcbuf.pkt.jp_len)) < 0) ;
+		if (b->nb_count > NET_BATCH_MAX) continue;
+
+		// The NIC reads the frames out of the page itself.  The
+		// kernel holds on to it until then, so the next receive can
+		// go ahead and replace it.
+		for (i = 0; i < b->nb_count; i++) {
+			frags[i].nf_page = &nsipcbuf;
+			frags[i].nf_off = b->nb_frames[i].nbf_off;
+			frags[i].nf_len = b->nb_frames[i].nbf_len;
+			frags[i].nf_flags = NET_FRAG_EOP;
+		}
+		for (i = 0; i < b->nb_count; i += n) {
+			if ((n = sys_net_send_batch(frags + i, b->nb_count - i, &seq)) < 0)
+				break;
+			if (n == 0)	// The ring is full
+				sys_yield();
+		}
 	}
 }
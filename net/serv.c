@@ -47,6 +47,10 @@ static envid_t timer_envid;
 static envid_t input_envid;
 static envid_t output_envid;
 
+// Whether lwIP has the NIC's rings mapped (see jif_netmap), in which
+// case there are no input and output environments.
+static bool netmapped;
+
 static bool buse[QUEUE_SIZE];
 static int next_i(int i) { return (i+1) % QUEUE_SIZE; }
 static int prev_i(int i) { return (i ? i-1 : QUEUE_SIZE-1); }
@@ -111,6 +115,23 @@ net_timer(uint32_t arg)
 	}
 }
 
+// Feeds lwIP the frames in the mapped receive ring, sleeping in the
+// kernel when there are none.  Releasing the core lock hands the slots
+// back to the NIC.
+static void __attribute__((noreturn))
+net_netmap(uint32_t arg)
+{
+	int n;
+
+	for (;;) {
+		lwip_core_lock();
+		n = jif_netmap_input(&nif);
+		lwip_core_unlock();
+		if (n == 0)
+			sys_net_sync(1);
+	}
+}
+
 static void
 start_timer(struct timer_thread *t, void (*func)(void), const char *name, int msec)
 {
@@ -147,6 +168,8 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 	start_timer(&t_arp, &etharp_tmr, "arp timer", ARP_TMR_INTERVAL);
 	start_timer(&t_tcpf, &tcp_fasttmr, "tcp f timer", TCP_FAST_INTERVAL);
 	start_timer(&t_tcps, &tcp_slowtmr, "tcp s timer", TCP_SLOW_INTERVAL);
+	if (netmapped && (r = thread_create(0, "netmap", &net_netmap, 0)) < 0)
+		panic("cannot create netmap thread: %s", e2s(r));
 
 	struct in_addr ia = {ipaddr};
 	cprintf("ns: %02x:%02x:%02x:%02x:%02x:%02x"
@@ -162,19 +185,65 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 
 static void
 process_timer(envid_t envid) {
-	uint32_t start, now, to;
-
 	if (envid != timer_envid) {
 		cprintf("NS: received timer interrupt from envid %x not timer env\n", envid);
 		return;
 	}
 
-	start = sys_time_msec();
-	thread_yield();
-	now = sys_time_msec();
+	ipc_send(envid, TIMER_INTERVAL, 0, 0);
+}
+
+// The most recent reply from a serve_thread, held back so that serve()
+// can send it together with its next receive in ipc_reply_wait.
+// Protected by the lwIP core lock, which serve() drops while it is
+// blocked receiving (serve_recving); a reply that comes in then is sent
+// right away instead, since serve() would not see it until the next
+// request.
+static envid_t reply_whom;
+static int32_t reply_val;
+static bool serve_recving;
 
-	to = TIMER_INTERVAL - (now - start);
-	ipc_send(envid, to, 0, 0);
+static void
+queue_reply(envid_t whom, int32_t r)
+{
+	if (serve_recving) {
+		ipc_send(whom, r, 0, 0);
+		return;
+	}
+	if (reply_whom)
+		ipc_send(reply_whom, reply_val, 0, 0);
+	reply_whom = whom;
+	reply_val = r;
+}
+
+// Received pages that lwIP is holding on to (see serve_input).  Past
+// RX_HELD_MAX, packets are copied out of their page instead, so that
+// queued TCP data cannot use up the REQVA buffers.
+#define RX_HELD_MAX	(QUEUE_SIZE / 2)
+static int rx_held;
+
+static void
+release_input(void *va)
+{
+	rx_held--;
+	put_buffer(va);
+	sys_page_unmap(0, va);
+}
+
+// Run a received packet through lwIP.  Usually lwIP keeps the page
+// itself, which came from the NIC without being copied, and gives it
+// back through release_input.
+static void
+serve_input(void *va)
+{
+	if (rx_held < RX_HELD_MAX) {
+		rx_held++;
+		jif_input_page(&nif, va, release_input);
+		return;
+	}
+	jif_input(&nif, va);
+	put_buffer(va);
+	sys_page_unmap(0, va);
 }
 
 struct st_args {
@@ -189,6 +258,7 @@ serve_thread(uint32_t a) {
 	union Nsipc *req = args->req;
 	int r;
 
+	lwip_core_lock();
 	switch (args->reqno) {
 	case NSREQ_ACCEPT:
 	{
@@ -230,10 +300,6 @@ serve_thread(uint32_t a) {
 		r = lwip_socket(req->socket.req_domain, req->socket.req_type,
 				req->socket.req_protocol);
 		break;
-	case NSREQ_INPUT:
-		jif_input(&nif, (void *)&req->pkt);
-		r = 0;
-		break;
 	default:
 		cprintf("Invalid request code %d from %08x\n", args->whom, args->req);
 		r = -E_INVAL;
@@ -246,31 +312,34 @@ serve_thread(uint32_t a) {
 		perror(buf);
 	}
 
-	if (args->reqno != NSREQ_INPUT)
-		ipc_send(args->whom, r, 0, 0);
+	queue_reply(args->whom, r);
 
 	put_buffer(args->req);
 	sys_page_unmap(0, (void*) args->req);
 	free(args);
+	lwip_core_unlock();
 }
 
 void
 serve(void) {
 	int32_t reqno;
 	uint32_t whom;
-	int i, perm;
+	envid_t to;
+	int perm, r;
 	void *va;
 
+	lwip_core_lock();
 	while (1) {
-		// ipc_recv will block the entire process, so we flush
-		// all pending work from other threads.  We limit the
-		// number of yields in case there's a rogue thread.
-		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
-			thread_yield();
-
 		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		to = reply_whom;
+		reply_whom = 0;
+		serve_recving = 1;
+		lwip_core_unlock();
+		reqno = ipc_reply_wait(to, reply_val, 0, 0,
+				       (envid_t *) &whom, (void *) va, &perm);
+		lwip_core_lock();
+		serve_recving = 0;
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
@@ -288,18 +357,44 @@ serve(void) {
 			continue; // just leave it hanging...
 		}
 
+		// Packets never block, so they need no thread.
+		if (reqno == NSREQ_INPUT) {
+			serve_input(va);
+			continue;
+		}
+		if (reqno == NSREQ_INPUT_BATCH) {
+			jif_input_batch(&nif, va);
+			put_buffer(va);
+			sys_page_unmap(0, va);
+			continue;
+		}
+
 		// Since some lwIP socket calls will block, create a thread and
-		// process the rest of the request in the thread.
+		// process the rest of the request in the thread.  It starts
+		// once we drop the core lock to wait for the next request.
+		// When every thread slot is taken by a blocked call, the
+		// request fails instead: waiting here for a slot would also
+		// hold up the packets that could unblock those calls.
 		struct st_args *args = malloc(sizeof(struct st_args));
-		if (!args)
-			panic("could not allocate thread args structure");
+		if (!args) {
+			r = -E_NO_MEM;
+			goto fail;
+		}
 
 		args->reqno = reqno;
 		args->whom = whom;
 		args->req = va;
 
-		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
-		thread_yield(); // let the thread created run
+		r = thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
+		if (r >= 0)
+			continue;
+		free(args);
+	fail:
+		if (debug)
+			cprintf("ns req %d from %08x: %e\n", reqno, whom, r);
+		queue_reply(whom, r);
+		put_buffer(va);
+		sys_page_unmap(0, va);
 	}
 }
 
@@ -327,30 +422,32 @@ umain(int argc, char **argv)
 		return;
 	}
 
-	// fork off the input thread which will poll the NIC driver for input
-	// packets
-	input_envid = fork();
-	if (input_envid < 0)
-		panic("error forking");
-	else if (input_envid == 0) {
-		input(ns_envid);
-		return;
-	}
+	// Drive the NIC's rings directly if the kernel lets us map them,
+	// and only fall back to the input and output environments if not.
+	netmapped = jif_netmap((void *) NETMAP) >= 0;
+	if (!netmapped) {
+		// fork off the input thread which will poll the NIC driver for input
+		// packets
+		input_envid = fork();
+		if (input_envid < 0)
+			panic("error forking");
+		else if (input_envid == 0) {
+			input(ns_envid);
+			return;
+		}
 
-	// fork off the output thread that will send the packets to the NIC
-	// driver
-	output_envid = fork();
-	if (output_envid < 0)
-		panic("error forking");
-	else if (output_envid == 0) {
-		output(ns_envid);
-		return;
+		// fork off the output thread that will send the packets to the NIC
+		// driver
+		output_envid = fork();
+		if (output_envid < 0)
+			panic("error forking");
+		else if (output_envid == 0) {
+			output(ns_envid);
+			return;
+		}
 	}
 
-	// lwIP requires a user threading library; start the library and jump
-	// into a thread to continue initialization.
-	thread_init();
-	thread_create(0, "main", tmain, 0);
-	thread_yield();
-	// never coming here!
+	// lwIP runs on threads made by sfork; this environment stays the
+	// one that clients send requests to.
+	tmain(0);
 }
@@ -24,8 +24,11 @@ announce(void)
 	if ((r = sys_page_alloc(0, pkt, PTE_P|PTE_U|PTE_W)) < 0)
 		panic("sys_page_map: %e", r);
 
-	struct etharp_hdr *arp = (struct etharp_hdr*)pkt->jp_data;
-	pkt->jp_len = sizeof(*arp);
+	struct NetBatch *b = (struct NetBatch*)pkt;
+	struct etharp_hdr *arp = (struct etharp_hdr*)(b + 1);
+	b->nb_count = 1;
+	b->nb_frames[0].nbf_off = sizeof(*b);
+	b->nb_frames[0].nbf_len = sizeof(*arp);
 
 	memset(arp->ethhdr.dest.addr, 0xff, ETHARP_HWADDR_LEN);
 	memcpy(arp->ethhdr.src.addr,  mac,  ETHARP_HWADDR_LEN);
@@ -100,12 +103,21 @@ umain(int argc, char **argv)
 			panic("ipc_recv: %e", req);
 		if (whom != input_envid)
 			panic("IPC from unexpected environment %08x", whom);
-		if (req != NSREQ_INPUT)
+		if (req == NSREQ_INPUT) {
+			hexdump("input: ", pkt->jp_data, pkt->jp_len);
+			cprintf("\n");
+		} else if (req == NSREQ_INPUT_BATCH) {
+			// Several small packets, one after another
+			struct NetBatch *b = (struct NetBatch*)pkt;
+			for (i = 0; i < b->nb_count; i++) {
+				hexdump("input: ",
+					(char*)b + b->nb_frames[i].nbf_off,
+					b->nb_frames[i].nbf_len);
+				cprintf("\n");
+			}
+		} else
 			panic("Unexpected IPC %d", req);
 
-		hexdump("input: ", pkt->jp_data, pkt->jp_len);
-		cprintf("\n");
-
 		// Only indicate that we're waiting for packets once
 		// we've received the ARP reply
 		if (first)
@@ -6,7 +6,7 @@
 
 static envid_t output_envid;
 
-static struct jif_pkt *pkt = (struct jif_pkt*)REQVA;
+static struct NetBatch *pkt = (struct NetBatch*)REQVA;
 
 
 void
@@ -28,9 +28,11 @@ umain(int argc, char **argv)
 	for (i = 0; i < TESTOUTPUT_COUNT; i++) {
 		if ((r = sys_page_alloc(0, pkt, PTE_P|PTE_U|PTE_W)) < 0)
 			panic("sys_page_alloc: %e", r);
-		pkt->jp_len = snprintf(pkt->jp_data,
-				       PGSIZE - sizeof(pkt->jp_len),
-				       "Packet %02d", i);
+		pkt->nb_count = 1;
+		pkt->nb_frames[0].nbf_off = sizeof(*pkt);
+		pkt->nb_frames[0].nbf_len = snprintf((char*)(pkt + 1),
+						     PGSIZE - sizeof(*pkt),
+						     "Packet %02d", i);
 		cprintf("Transmitting packet %d\n", i);
 		ipc_send(output_envid, NSREQ_OUTPUT, pkt, PTE_P|PTE_W|PTE_U);
 		sys_page_unmap(0, pkt);
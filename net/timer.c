@@ -2,17 +2,17 @@
 
 void
 timer(envid_t ns_envid, uint32_t initial_to) {
-	int r;
-	uint32_t stop = sys_time_msec() + initial_to;
+	int32_t left;
+	uint32_t stop = sys_time_usec() + initial_to * 1000;
 
 	binaryname = "ns_timer";
 
 	while (1) {
-		while((r = sys_time_msec()) < stop && r >= 0) {
-			sys_yield();
-		}
-		if (r < 0)
-			panic("sys_time_msec: %e", r);
+		// Sleep until the deadline, to the microsecond, rather
+		// than spinning in sys_yield.  The clock wraps, so
+		// compare differences.
+		while ((left = stop - sys_time_usec()) > 0)
+			sys_sleep_usec(left);
 
 		ipc_send(ns_envid, NSREQ_TIMER, 0, 0);
 
@@ -25,7 +25,7 @@ timer(envid_t ns_envid, uint32_t initial_to) {
 				continue;
 			}
 
-			stop = sys_time_msec() + to;
+			stop = sys_time_usec() + to * 1000;
 			break;
 		}
 	}
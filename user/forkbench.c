@@ -0,0 +1,47 @@
+// Measure fork latency with a large address space, comparing the
+// kernel's copy-on-write fork against the user-level ufork, which
+// maps every page with one system call.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES		4096	// 16MB
+#define NFORKS		10
+
+static char buf[NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// Fork NFORKS children with f, each of which writes one page and exits.
+// Returns the average TSC cycles from calling f to its return in the
+// parent.
+static uint64_t
+time_fork(envid_t (*f)(void))
+{
+	uint64_t total = 0, start;
+	envid_t who;
+	int i;
+
+	for (i = 0; i < NFORKS; i++) {
+		start = read_tsc();
+		if ((who = f()) < 0)
+			panic("fork: %e", who);
+		if (who == 0) {
+			buf[0] = 1;
+			exit();
+		}
+		total += read_tsc() - start;
+		wait(who);
+	}
+	return total / NFORKS;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i;
+
+	for (i = 0; i < NPAGES; i++)
+		buf[i * PGSIZE] = 0;
+
+	cprintf("fork:  %llu cycles\n", time_fork(fork));
+	cprintf("ufork: %llu cycles\n", time_fork(ufork));
+}
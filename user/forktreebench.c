@@ -0,0 +1,62 @@
+// Fork a binary tree of processes, as in forktree, but deeper and with
+// a 16MB address space in every process, and report the average fork
+// latency.  Since fork shares page tables, the latency should hardly
+// depend on NPAGES.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define DEPTH		6
+#define NNODES		(2 << DEPTH)	// Node i has children 2i and 2i+1
+#define NPAGES		4096
+
+// Shared between all the processes (mapped PTE_SHARE, so fork does not
+// copy it).  cycles[i] is the fork latency seen by node i's parent.
+struct Results {
+	volatile uint64_t cycles[NNODES];
+};
+#define RESULTS	((struct Results *) 0xA0000000)
+
+static char buf[NPAGES * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+static void
+forktree(int node, int depth)
+{
+	uint64_t start;
+	envid_t who;
+	int i;
+
+	if (depth == DEPTH)
+		return;
+	for (i = 0; i < 2; i++) {
+		start = read_tsc();
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0) {
+			forktree(2 * node + i, depth + 1);
+			exit();
+		}
+		RESULTS->cycles[2 * node + i] = read_tsc() - start;
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t total = 0;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, RESULTS, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		buf[i * PGSIZE] = 0;
+
+	forktree(1, 0);
+	for (i = 2; i < NNODES; i++) {
+		while (!RESULTS->cycles[i])
+			sys_yield();
+		total += RESULTS->cycles[i];
+	}
+	cprintf("%d forks of %d pages: %llu cycles/fork\n",
+		NNODES - 2, NPAGES, total / (NNODES - 2));
+}
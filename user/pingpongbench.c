@@ -0,0 +1,64 @@
+// Measure the cost of an IPC round trip between two environments, as
+// in pingpong, both with nothing else going on and with each side
+// touching a few pages of memory per message, so that TLB misses after
+// each address space switch show up in the numbers.
+// Run with CPUS=1 so that every message is a switch on one CPU.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS		10000
+#define NTOUCH		32
+
+static volatile char buf[NTOUCH * PGSIZE];
+
+static void
+touch(int npages)
+{
+	int i;
+
+	for (i = 0; i < npages; i++)
+		buf[i * PGSIZE]++;
+}
+
+// Ping-pong with 'who' NROUNDS times, touching npages pages on every
+// receive.  The parent returns the average TSC cycles per round trip.
+static uint64_t
+bounce(envid_t who, bool parent, int npages)
+{
+	uint64_t start = read_tsc();
+	int i;
+
+	for (i = 0; i < NROUNDS; i++) {
+		if (parent)
+			ipc_send(who, i, 0, 0);
+		ipc_recv(&who, 0, 0);
+		touch(npages);
+		if (!parent)
+			ipc_send(who, i, 0, 0);
+	}
+	return (read_tsc() - start) / NROUNDS;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint64_t cold, warm;
+
+	// Take the copy-on-write faults on buf before starting the clock.
+	who = fork();
+	touch(NTOUCH);
+	if (who == 0) {
+		who = thisenv->env_parent_id;
+		bounce(who, false, 0);
+		bounce(who, false, NTOUCH);
+		return;
+	}
+
+	warm = bounce(who, true, 0);
+	cold = bounce(who, true, NTOUCH);
+	cprintf("round trip: %llu cycles, %llu cycles/switch\n", warm, warm / 2);
+	cprintf("round trip touching %d pages: %llu cycles, %llu cycles/switch\n",
+		NTOUCH, cold, cold / 2);
+}
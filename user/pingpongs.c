@@ -5,19 +5,10 @@
 
 uint32_t val;
 
-void
-umain(int argc, char **argv)
+static void
+pingpong(void *arg)
 {
 	envid_t who;
-	uint32_t i;
-
-	i = 0;
-	if ((who = sfork()) != 0) {
-		cprintf("i am %08x; thisenv is %p\n", sys_getenvid(), thisenv);
-		// get the ball rolling
-		cprintf("send 0 from %x to %x\n", sys_getenvid(), who);
-		ipc_send(who, 0, 0, 0);
-	}
 
 	while (1) {
 		ipc_recv(&who, 0, 0);
@@ -29,5 +20,18 @@ umain(int argc, char **argv)
 		if (val == 10)
 			return;
 	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
 
+	if ((who = sfork(pingpong, 0, 0)) < 0)
+		panic("sfork: %e", who);
+	cprintf("i am %08x; thisenv is %p\n", sys_getenvid(), thisenv);
+	// get the ball rolling
+	cprintf("send 0 from %x to %x\n", sys_getenvid(), who);
+	ipc_send(who, 0, 0, 0);
+	pingpong(0);
 }
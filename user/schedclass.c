@@ -0,0 +1,108 @@
+// Measure how the scheduler shares the CPU between CPU-bound
+// environments of different nice values, and how long each of them
+// waits when it is preempted.
+// Run with CPUS=1 to see the weighted shares; with more CPUs the
+// spinners spread out and each gets a whole CPU.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCHILD		3
+#define WINDOW_MSEC	2000
+#define GAP_MIN		20000	// TSC cycles; a longer gap means we were off the CPU
+#define MAXGAPS		512
+
+static const int nices[NCHILD] = { -5, 0, 5 };
+static const uint32_t weights[NCHILD] = { 3121, 1024, 335 };
+
+// Shared between parent and children (mapped PTE_SHARE, so fork
+// does not copy it).
+struct Results {
+	volatile bool stop;
+	struct {
+		volatile bool done;
+		uint32_t ngaps;
+		uint32_t p50, p90, p99, max;
+	} child[NCHILD];
+};
+#define RESULTS	((struct Results *) 0xA0000000)
+
+static uint32_t gaps[MAXGAPS];
+
+static uint32_t
+percentile(uint32_t *v, int n, int p)
+{
+	return n ? v[(n - 1) * p / 100] : 0;
+}
+
+static void
+spin(int i)
+{
+	uint64_t last, now;
+	int n = 0;
+
+	sys_env_set_priority(0, nices[i]);
+	last = read_tsc();
+	while (!RESULTS->stop) {
+		now = read_tsc();
+		if (now - last > GAP_MIN && n < MAXGAPS)
+			gaps[n++] = now - last;
+		last = now;
+	}
+
+	sort(gaps, n);
+	RESULTS->child[i].ngaps = n;
+	RESULTS->child[i].p50 = percentile(gaps, n, 50);
+	RESULTS->child[i].p90 = percentile(gaps, n, 90);
+	RESULTS->child[i].p99 = percentile(gaps, n, 99);
+	RESULTS->child[i].max = n ? gaps[n - 1] : 0;
+	RESULTS->child[i].done = 1;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NCHILD];
+	uint64_t start[NCHILD], used[NCHILD], total = 0;
+	uint32_t wsum = 0;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, RESULTS, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			spin(i);
+			return;
+		}
+		kids[i] = r;
+	}
+
+	for (i = 0; i < NCHILD; i++)
+		start[i] = envs[ENVX(kids[i])].env_runtime;
+	// Sleep through the window; a waking sleeper gets a head start on
+	// the spinners, so we are back on the CPU in time to end it.
+	sys_sleep_usec(WINDOW_MSEC * 1000);
+	for (i = 0; i < NCHILD; i++) {
+		used[i] = envs[ENVX(kids[i])].env_runtime - start[i];
+		total += used[i];
+		wsum += weights[i];
+	}
+
+	RESULTS->stop = 1;
+	for (i = 0; i < NCHILD; i++)
+		while (!RESULTS->child[i].done)
+			sys_yield();
+
+	cprintf("env       nice  share  fair   preemption gap (cycles): n p50 p90 p99 max\n");
+	for (i = 0; i < NCHILD; i++)
+		cprintf("%08x  %4d  %4d%%  %4d%%  %u %u %u %u %u\n",
+			kids[i], nices[i],
+			total ? (int) (used[i] * 100 / total) : 0,
+			weights[i] * 100 / wsum,
+			RESULTS->child[i].ngaps, RESULTS->child[i].p50,
+			RESULTS->child[i].p90, RESULTS->child[i].p99,
+			RESULTS->child[i].max);
+}
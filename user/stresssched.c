@@ -1,12 +1,17 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NLAT	100
 
 volatile int counter;
+static uint32_t lat[NLAT];
 
 void
 umain(int argc, char **argv)
 {
 	int i, j;
 	int seen;
+	uint64_t t;
 	envid_t parent = sys_getenvid();
 
 	// Fork several environments
@@ -35,5 +40,18 @@ umain(int argc, char **argv)
 	// Check that we see environments running on different CPUs
 	cprintf("[%08x] stresssched on CPU %d\n", thisenv->env_id, thisenv->env_cpunum);
 
+	// Report how long a sys_yield keeps us off the CPU while the
+	// others compete, and how much CPU time we got overall.
+	for (i = 0; i < NLAT; i++) {
+		t = read_tsc();
+		sys_yield();
+		lat[i] = read_tsc() - t;
+	}
+	sort(lat, NLAT);
+	cprintf("[%08x] stresssched yield latency p50 %u p90 %u p99 %u cycles, "
+		"ran %llu cycles\n", thisenv->env_id, lat[NLAT / 2],
+		lat[NLAT * 9 / 10], lat[NLAT * 99 / 100],
+		thisenv->env_runtime);
+
 }
 
@@ -0,0 +1,38 @@
+// Compare the latency of a null system call entered with
+// int $T_SYSCALL against one entered with sysenter.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALLS	100000
+
+// Average TSC cycles per sys_getenvid() with the current entry path.
+static uint64_t
+cycles_per_call(void)
+{
+	uint64_t start;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NCALLS; i++)
+		sys_getenvid();
+	return (read_tsc() - start) / NCALLS;
+}
+
+void
+umain(int argc, char **argv)
+{
+	bool saved = syscall_use_sysenter;
+
+	syscall_use_sysenter = 0;
+	cprintf("int $T_SYSCALL: %llu cycles/call\n", cycles_per_call());
+
+	if (!sysenter_supported()) {
+		cprintf("sysenter: not supported on this CPU\n");
+		return;
+	}
+	syscall_use_sysenter = 1;
+	cprintf("sysenter:       %llu cycles/call\n", cycles_per_call());
+
+	syscall_use_sysenter = saved;
+}
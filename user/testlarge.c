@@ -0,0 +1,57 @@
+// Check that a 4MB page survives fork and ufork: the child and the
+// parent each get their own copy once either one writes to it.
+
+#include <inc/lib.h>
+
+#define VA0	((uint32_t *) 0xA0000000)
+#define NWORDS	(PTSIZE / sizeof(uint32_t))
+
+static uint32_t *VA;
+
+static void
+check(const char *who, uint32_t i, uint32_t want)
+{
+	if (VA[i] != want)
+		panic("%s: word %u is %08x, want %08x", who, i, VA[i], want);
+}
+
+// Allocate a 4MB page at va, fork with f, and check what each side
+// sees once both have written to it.
+static void
+test_fork(const char *name, envid_t (*f)(void), uint32_t *va)
+{
+	envid_t envid;
+	int r;
+
+	VA = va;
+	if ((r = sys_page_alloc_large(0, VA, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc_large: %e", r);
+
+	VA[0] = 0x11111111;
+	VA[NWORDS - 1] = 0x22222222;
+	if ((envid = f()) < 0)
+		panic("%s: %e", name, envid);
+	if (envid == 0) {
+		check("child", 0, 0x11111111);
+		check("child", NWORDS - 1, 0x22222222);
+		// This write splits the child's copy of the 4MB page.
+		VA[NWORDS / 2] = 0x33333333;
+		check("child", NWORDS / 2, 0x33333333);
+		check("child", 0, 0x11111111);
+		check("child", NWORDS - 1, 0x22222222);
+		exit();
+	}
+	wait(envid);
+	check("parent", NWORDS / 2, 0);
+	VA[NWORDS - 1] = 0x44444444;
+	check("parent", NWORDS - 1, 0x44444444);
+	check("parent", 0, 0x11111111);
+	cprintf("%s handles 4MB pages right\n", name);
+}
+
+void
+umain(int argc, char **argv)
+{
+	test_fork("fork", fork, VA0);
+	test_fork("ufork", ufork, VA0 + NWORDS);
+}
@@ -0,0 +1,20 @@
+// Check that an ordinary environment may change its nice value but
+// cannot make itself real-time.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	if ((r = sys_env_set_priority(0, ENV_PRIO_RT_MIN)) != -E_INVAL)
+		panic("RT priority %d: got %d, want -E_INVAL",
+		      ENV_PRIO_RT_MIN, r);
+	if ((r = sys_env_set_priority(0, ENV_PRIO_RT_MAX)) != -E_INVAL)
+		panic("RT priority %d: got %d, want -E_INVAL",
+		      ENV_PRIO_RT_MAX, r);
+	if ((r = sys_env_set_priority(0, ENV_PRIO_NICE_MIN)) < 0)
+		panic("nice value %d: %e", ENV_PRIO_NICE_MIN, r);
+	cprintf("real-time priority refused\n");
+}
@@ -0,0 +1,57 @@
+// Start NTHREADS threads with sfork that take turns incrementing a
+// counter under one mutex, and report the cycles per lock/unlock pair.
+// The main thread waits for them on a condition variable.
+// With CPUS>1 the threads run in parallel and the mutex is contended.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NTHREADS	4
+#define NROUNDS		10000
+
+static struct Mutex lock;
+static struct Cond done_cond;
+static uint32_t counter;
+static int ndone;
+
+static void
+worker(void *arg)
+{
+	int i;
+
+	for (i = 0; i < NROUNDS; i++) {
+		mutex_lock(&lock);
+		counter++;
+		mutex_unlock(&lock);
+	}
+
+	mutex_lock(&lock);
+	ndone++;
+	cond_signal(&done_cond);
+	mutex_unlock(&lock);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start, cycles;
+	envid_t who;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NTHREADS; i++) {
+		if ((who = sfork(worker, 0, 0)) < 0)
+			panic("sfork: %e", who);
+	}
+
+	mutex_lock(&lock);
+	while (ndone < NTHREADS)
+		cond_wait(&done_cond, &lock);
+	mutex_unlock(&lock);
+	cycles = read_tsc() - start;
+
+	if (counter != NTHREADS * NROUNDS)
+		panic("counter is %u, expected %u", counter, NTHREADS * NROUNDS);
+	cprintf("%d threads: %llu cycles per lock/unlock\n",
+		NTHREADS, cycles / (NTHREADS * NROUNDS));
+}